@@ -4,9 +4,11 @@
  * $Id: helper.c,v 1.13 2006-05-31 01:47:49 jguerra Exp $
  */
 
+#define _XOPEN_SOURCE 600
 #include <stdlib.h>
 #include <string.h>
-#include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -22,15 +24,8 @@
 	} while (0)
 #endif
 
-#ifndef TIMEVAL_TO_TIMESPEC
-# define TIMEVAL_TO_TIMESPEC(tv, ts) {						\
-	(ts)->tv_sec = (tv)->tv_sec;							\
-	(ts)->tv_nsec = (tv)->tv_usec * 1000;					\
-}
-#endif
-
-#ifndef timeradd
-# define timeradd(a, b, result)								\
+#ifndef TIMESPEC_ADD
+# define TIMESPEC_ADD(a, b, result)							\
 	do {													\
 		(result)->tv_sec = (a)->tv_sec + (b)->tv_sec;		\
 		(result)->tv_nsec = (a)->tv_nsec + (b)->tv_nsec;	\
@@ -45,6 +40,8 @@
 static const char TaskType[] = "__HelperTaskType__";
 static const char QueueType[] = "__HelperQueueType__";
 static const char ThreadType[] = "__HelperThreadType__";
+static const char DispatcherType[] = "__HelperDispatcherType__";
+static const char FlowType[] = "__HelperFlowType__";
 
 typedef enum {
 	TSK_NULL,
@@ -52,18 +49,41 @@ typedef enum {
 	TSK_WAITING,
 	TSK_BUSY,
 	TSK_PAUSED,
+	TSK_YIELDED,
 	TSK_DONE,
 	TSK_FINISHED
 } task_state;
 
+/* per task type statistics, shared by all tasks created with the same ops */
+typedef struct tasktype_t {
+	const task_ops *ops;
+	pthread_mutex_t lock;
+	double cost;					/* moving average of work() time, in seconds */
+	unsigned long runs;
+	int signals;					/* work() has signalled or yielded */
+	int detaches;					/* work() has detached */
+} tasktype_t;
+
+#define TT_MINRUNS		8			/* samples needed before trusting the average */
+#define POOL_MAXTHREADS	256
+
 typedef struct task_t {
 	const char *type;
 	struct task_t *next;
 	task_state state;
 	pthread_mutex_t lock;
 	pthread_cond_t unpaused;
-	task_ops *ops;
+	struct queue_t *in;
+	struct queue_t *out;
+	tasktype_t *tt;
+	const task_ops *ops;
+	int tclass;
 	void *udata;
+	double queued;
+	int posted;						/* in the output queue, not yet updated */
+	struct coro_t *owner;			/* coroutine waiting for this task, if any */
+	struct flow_t *flow;			/* fair-queued, in flight */
+	int children;					/* subtasks not yet finished, see spawn_subtask() */
 } task_t;
 
 typedef struct queue_t {
@@ -80,6 +100,9 @@ typedef struct thread_t {
 	int ref_in, ref_out;
 	task_t *task;
 	int signal;
+	int yield;
+	int detach;
+	int spawned;					/* the current task's work() has spawned subtasks */
 } thread_t;
 
 /********************************************
@@ -87,10 +110,15 @@ typedef struct thread_t {
  *******************************************/
 
 static void q_init (queue_t *q) {
+	pthread_condattr_t attr;
+	
 	q->head = NULL;
 	q->tail = NULL;
 	pthread_mutex_init (&q->lock, NULL);
-	pthread_cond_init (&q->notempty, NULL);
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&q->notempty, &attr);
+	pthread_condattr_destroy (&attr);
 }
 
 static void q_push (queue_t *q, task_t *t) {
@@ -161,7 +189,11 @@ static task_t *q_pop (queue_t *q) {
 	return t;
 }
 
-static task_t *q_wait (queue_t *q, const struct timespec *timeout) {
+/*
+ * also returns NULL when *stop is set, see q_wakeall().
+ * *waited tells if the queue was empty when called
+ */
+static task_t *q_waitstop (queue_t *q, const struct timespec *timeout, const int *stop, int *waited) {
 	int ret = 0;
 	task_t *t = NULL;
 	
@@ -169,7 +201,11 @@ static task_t *q_wait (queue_t *q, const struct timespec *timeout) {
 		return NULL;
 	
 	pthread_mutex_lock (&q->lock);
-	while (q->head == NULL) {
+	if (waited)
+		*waited = q->head == NULL;
+	while (q->head == NULL && ret == 0) {
+		if (stop && *stop)
+			break;
 		if (timeout)
 			ret = pthread_cond_timedwait (&q->notempty, &q->lock, timeout);
 		else
@@ -191,6 +227,17 @@ static task_t *q_wait (queue_t *q, const struct timespec *timeout) {
 	return t;
 }
 
+static task_t *q_wait (queue_t *q, const struct timespec *timeout) {
+	return q_waitstop (q, timeout, NULL, NULL);
+}
+
+/* wakes the threads waiting on the queue, to check their stop flags */
+static void q_wakeall (queue_t *q) {
+	pthread_mutex_lock (&q->lock);
+	pthread_cond_broadcast (&q->notempty);
+	pthread_mutex_unlock (&q->lock);
+}
+
 static void q_free (queue_t *q) {
 	task_t *t = NULL;
 	if (!q)
@@ -221,6 +268,169 @@ static void tsk_setstate (task_t *t, task_state state) {
 	pthread_mutex_unlock (&t->lock);
 }
 
+static double now_secs (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* absolute time for q_wait(), secs from now; queues wait on CLOCK_MONOTONIC */
+static void abs_timeout (double secs, struct timespec *ts) {
+	struct timespec now;
+	
+	if (secs < 0)
+		secs = 0;
+	NUMBER_TO_TIMESPEC (secs, ts);
+	clock_gettime (CLOCK_MONOTONIC, &now);
+	TIMESPEC_ADD (ts, &now, ts);
+}
+
+/*
+ * average cost of taking a task to a helper and back: twice the time
+ * an idle helper takes to pick a new task, measured by thread_work()
+ */
+static double handoff_cost = 20e-6;
+static pthread_mutex_t handoff_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void handoff_record (double hop) {
+	pthread_mutex_lock (&handoff_lock);
+	handoff_cost += (2 * hop - handoff_cost) / 32;
+	pthread_mutex_unlock (&handoff_lock);
+}
+
+static void tt_record (tasktype_t *tt, double cost) {
+	if (!tt)
+		return;
+	
+	pthread_mutex_lock (&tt->lock);
+	if (tt->runs == 0)
+		tt->cost = cost;
+	else
+		tt->cost += (cost - tt->cost) / 8;
+	tt->runs++;
+	pthread_mutex_unlock (&tt->lock);
+}
+
+static int tt_cheap (tasktype_t *tt) {
+	double handoff;
+	int cheap;
+	
+	if (!tt)
+		return 0;
+	
+	pthread_mutex_lock (&handoff_lock);
+	handoff = handoff_cost;
+	pthread_mutex_unlock (&handoff_lock);
+	
+	pthread_mutex_lock (&tt->lock);
+	cheap = !tt->signals && !tt->detaches && tt->runs >= TT_MINRUNS && tt->cost < handoff;
+	pthread_mutex_unlock (&tt->lock);
+	return cheap;
+}
+
+/* work() doesn't just return when done, never run it inline */
+static void tt_signal (tasktype_t *tt) {
+	if (!tt)
+		return;
+	
+	pthread_mutex_lock (&tt->lock);
+	tt->signals = 1;
+	pthread_mutex_unlock (&tt->lock);
+}
+
+static void tt_detach (tasktype_t *tt) {
+	if (!tt)
+		return;
+	
+	pthread_mutex_lock (&tt->lock);
+	tt->detaches = 1;
+	pthread_mutex_unlock (&tt->lock);
+}
+
+static int tt_signals (tasktype_t *tt) {
+	int signals;
+	
+	if (!tt)
+		return 0;
+	
+	pthread_mutex_lock (&tt->lock);
+	signals = tt->signals;
+	pthread_mutex_unlock (&tt->lock);
+	return signals;
+}
+
+static void tsk_work (task_t *t) {
+	tasktype_t *tt = t->tt;			/* a detached task could be gone when work() returns */
+	double start;
+	
+	if (!t->ops || !t->ops->work)
+		return;
+	
+	start = now_secs ();
+	t->ops->work (t->udata);
+	tt_record (tt, now_secs () - start);
+}
+
+/*
+ * a work() called without a helper (by the Lua thread, for a 'Ready'
+ * task, or within a batch) sees this instead of a thread_t: it can't
+ * give up the thread, so yield_task() just makes it run again right
+ * away, detach_task() returns NULL, signal_task() does nothing and
+ * spawn_subtask() runs the job in place.
+ */
+typedef struct sync_run {
+	int yielded;
+	int detached;
+} sync_run;
+
+static pthread_key_t sync_key;
+
+static void tsk_worksync (task_t *t) {
+	sync_run run;
+	void *prev = pthread_getspecific (sync_key);
+	
+	int yielded = 0;
+	
+	pthread_setspecific (sync_key, &run);
+	run.detached = 0;
+	do {
+		run.yielded = 0;
+		tsk_work (t);
+		yielded |= run.yielded;
+	} while (run.yielded);
+	pthread_setspecific (sync_key, prev);
+	
+	if (yielded)
+		tt_signal (t->tt);
+	if (run.detached)
+		tt_detach (t->tt);
+}
+
+/*
+ * sets the state and puts the task in the output queue,
+ * unless it's still there from a previous signal
+ */
+static void tsk_post (task_t *t, queue_t *out, task_state state) {
+	int posted;
+	
+	pthread_mutex_lock (&t->lock);
+	t->state = state;
+	if (state != TSK_PAUSED)
+		pthread_cond_broadcast (&t->unpaused);
+	posted = t->posted;
+	t->posted = 1;
+	pthread_mutex_unlock (&t->lock);
+	
+	if (!posted)
+		q_push (out, t);
+}
+
+static void tsk_free (task_t *t) {
+	pthread_cond_destroy (&t->unpaused);
+	pthread_mutex_destroy (&t->lock);
+	free (t);
+}
+
 /*******************************************
  *  userdata types functions
  *******************************************/
@@ -277,6 +487,16 @@ static task_t *new_task (lua_State *L) {
 	t->type = TaskType;
 	t->next = NULL;
 	t->state = TSK_NULL;
+	t->in = NULL;
+	t->out = NULL;
+	t->tt = NULL;
+	t->ops = NULL;
+	t->tclass = TASK_IO;
+	t->queued = 0;
+	t->posted = 0;
+	t->owner = NULL;
+	t->flow = NULL;
+	t->children = 0;
 	pthread_mutex_init (&t->lock, NULL);
 	pthread_cond_init (&t->unpaused, NULL);
 	
@@ -290,7 +510,7 @@ static task_t *new_task (lua_State *L) {
  */
 static int task_update (lua_State *L) {
 	int ret = 0;
-	task_state nxtstate;
+	task_state seen, nxtstate;
 	
 	task_t *t = check_task (L, 1);
 	lua_remove (L, 1);
@@ -298,11 +518,11 @@ static int task_update (lua_State *L) {
 		return 0;
 	
 	pthread_mutex_lock (&t->lock);
+	t->posted = 0;
 	
 	switch (t->state) {
 		case TSK_READY:
-			if (t->ops && t->ops->work)
-				t->ops->work (t->udata);
+			tsk_worksync (t);
 			t->state = TSK_DONE;
 			nxtstate = TSK_FINISHED;
 			break;
@@ -310,23 +530,36 @@ static int task_update (lua_State *L) {
 		case TSK_PAUSED:
 			nxtstate = TSK_BUSY;
 			break;
+		case TSK_YIELDED:
+			nxtstate = TSK_WAITING;
+			break;
 		case TSK_DONE:
 			nxtstate = TSK_FINISHED;
 			break;
 		default:
-			luaL_error (L, "the task is in the wrong state");
-			return 0;
+			pthread_mutex_unlock (&t->lock);
+			return luaL_error (L, "the task is in the wrong state");
 	}
+	seen = t->state;
+	pthread_mutex_unlock (&t->lock);
 	
-	if (t && t->ops && t->ops->update)
+	/* not locked: it can raise an error */
+	if (t->ops && t->ops->update)
 		ret = t->ops->update (L, t->udata);
-	t->state = nxtstate;
+	
+	pthread_mutex_lock (&t->lock);
+	if (t->state == seen)				/* or a helper has moved it on meanwhile */
+		t->state = nxtstate;
+	else
+		nxtstate = t->state;
 	if (t->state != TSK_PAUSED)
 		pthread_cond_broadcast (&t->unpaused);
-	if (t->state == TSK_FINISHED)					/* can this be dangerous??? */
-		free (t);
-	
 	pthread_mutex_unlock (&t->lock);
+	
+	if (nxtstate == TSK_WAITING)				/* resume a yielded task on any helper */
+		q_push (t->in, t);
+	else if (nxtstate == TSK_FINISHED)
+		tsk_free (t);
 	return ret;
 }
 
@@ -358,6 +591,9 @@ static int state (lua_State *L) {
 		case TSK_PAUSED:
 			s = "Paused";
 			break;
+		case TSK_YIELDED:
+			s = "Yielded";
+			break;
 		case TSK_DONE:
 			s = "Done";
 			break;
@@ -369,6 +605,42 @@ static int state (lua_State *L) {
 	return 1;
 }
 
+/*
+ * helper.tryinline (task)
+ * completes a 'Ready' task right here if it's cheaper than
+ * sending it to a helper. returns true if the task is now 'Done'
+ */
+static int tsk_tryinline (task_t *t) {
+	int done = 0;
+	
+	if (t->state == TSK_READY) {
+		if (t->ops && t->ops->try_inline && t->ops->try_inline (t->udata))
+			done = 1;
+		else if (t->tclass != TASK_IO && tt_cheap (t->tt)) {	/* I/O can block later */
+			tsk_worksync (t);
+			done = 1;
+		}
+		if (done)
+			t->state = TSK_DONE;
+	}
+	return done;
+}
+
+static int try_inline (lua_State *L) {
+	task_t *t = check_task (L, 1);
+	lua_pushboolean (L, tsk_tryinline (t));
+	return 1;
+}
+
+/*
+ * helper.now ()
+ * monotonic time in seconds, to measure intervals
+ */
+static int now (lua_State *L) {
+	lua_pushnumber (L, now_secs ());
+	return 1;
+}
+
 /*
  * helper.newqueue ()
  */
@@ -390,6 +662,7 @@ static int queue_addtask (lua_State *L) {
 	if (t && t->state != TSK_READY)
 		luaL_error (L, "task not 'Ready'");
 	tsk_setstate (t, TSK_WAITING);
+	t->queued = now_secs ();
 	q_push (q, t);
 	return 0;
 }
@@ -433,17 +706,9 @@ static int queue_wait (lua_State *L) {
 		t = q_wait (q, NULL);
 		
 	} else {
+		struct timespec ts;
 		
-		struct timeval tv;
-		struct timespec ts, now;
-		
-		lua_Number timeout = lua_tonumber (L, 2);
-		NUMBER_TO_TIMESPEC (timeout, &ts);
-		
-		gettimeofday (&tv, NULL);
-		TIMEVAL_TO_TIMESPEC (&tv, &now);
-		timeradd (&ts, &now, &ts);
-		
+		abs_timeout (lua_tonumber (L, 2), &ts);
 		t = q_wait (q, &ts);
 	}
 	
@@ -465,23 +730,44 @@ static int queue_gc (lua_State *L) {
 
 static pthread_key_t thread_key;
 
+static void subtask_release (task_t *t);
+
+/* tasks sent with helper.dispatch() carry their own output queue */
+static queue_t *tsk_out (thread_t *thrd, task_t *t) {
+	return t && t->out ? t->out : thrd->out;
+}
+
 static void *thread_work (void *arg) {
 	thread_t *thrd = (thread_t *)arg;
-	if (!thrd || !thrd->in || !thrd->out)
+	if (!thrd || !thrd->in)
 		return NULL;
 	
 	pthread_setspecific (thread_key, arg);
 	
 	while (!thrd->signal) {
-		task_t *t = q_wait (thrd->in, NULL);
+		int waited;
+		task_t *t = q_waitstop (thrd->in, NULL, &thrd->signal, &waited);
 		if (t) {
+			queue_t *out = tsk_out (thrd, t);
+			if (waited && t->queued)		/* just the hop, no backlog */
+				handoff_record (now_secs () - t->queued);
+			t->queued = 0;
 			thrd->task = t;
+			t->in = thrd->in;
 			t->state = TSK_BUSY;
-			if (t->ops && t->ops->work)
-				t->ops->work (t->udata);
-			tsk_setstate (t, TSK_DONE);
+			tsk_work (t);
+			if (thrd->spawned) {
+				thrd->spawned = 0;
+				thrd->detach = 0;
+				subtask_release (t);	/* done with work(), maybe not with the subtasks */
+			} else if (thrd->detach)
+				thrd->detach = 0;		/* not ours anymore, don't touch */
+			else if (thrd->yield) {
+				thrd->yield = 0;
+				tsk_post (t, out, TSK_YIELDED);
+			} else
+				tsk_post (t, out, TSK_DONE);
 		}
-		q_push (thrd->out, t);
 		thrd->task = NULL;
 	}
 	return NULL;
@@ -506,6 +792,9 @@ static int new_thread (lua_State *L) {
 	
 	thrd->task = NULL;
 	thrd->signal = 0;
+	thrd->yield = 0;
+	thrd->detach = 0;
+	thrd->spawned = 0;
 	
 	ret = pthread_create (&thrd->pth, NULL, thread_work, thrd);
 	if (ret)
@@ -556,6 +845,7 @@ static int thread_gc (lua_State *L) {
 	thread_t *thrd = check_thread (L, 1);
 	
 	thrd->signal = 1;
+	q_wakeall (thrd->in);
 	ret = pthread_join (thrd->pth, NULL);
 	if (ret)
 		luaL_error (L, "error %d (\"%s\") joining helper thread", ret, strerror (ret));
@@ -566,160 +856,1481 @@ static int thread_gc (lua_State *L) {
 	return 0;
 }
 
-static const struct luaL_reg queue_meths [] = {
-	{"addtask", queue_addtask},
-	{"remove", queue_removetask},
-	{"peek", queue_peek},
-	{"wait", queue_wait},
-	{"__gc", queue_gc},
-	{NULL, NULL}
-};
-static const struct luaL_reg thread_meths [] = {
-	{"currenttask", currenttask},
-	{"queues", thread_queues},
-	{"__gc", thread_gc},
-	{NULL, NULL}
-};
-static const struct luaL_reg helper_funcs [] = {
-	{"update", task_update},
-	{"state", state},
-	{"newqueue", new_queue},
-	{"newthread", new_thread},
-	{NULL, NULL}
-};
-
-/************************************************
- * C API
- ***********************************************/
-static int task_init (lua_State *L) {
-	int ret = 0;
-	
-	task_ops *ops = (task_ops *)lua_touserdata (L, lua_upvalueindex (1));
-	task_t *t = new_task (L);
-	t->ops = ops;
-	if (ops && ops->prepare)
-		ret = ops->prepare (L, &t->udata);
-	tsk_setstate (t, TSK_READY);
-	return ret+1;
+/**************************************************
+ *  shared pools, one for each task class
+ **************************************************/
+static const char *const class_names [] = {"io", "cpu", "latency", NULL};
+#define N_CLASSES	3
+
+typedef struct pool_t {
+	queue_t q;
+	int started;
+	int size;					/* target number of threads */
+	int nthreads;
+	thread_t *threads [POOL_MAXTHREADS];
+} pool_t;
+
+static pool_t pools [N_CLASSES];
+
+static void pool_init (pool_t *p, int size) {
+	q_init (&p->q);
+	p->started = 0;
+	p->size = size < POOL_MAXTHREADS ? size : POOL_MAXTHREADS;
+	p->nthreads = 0;
 }
 
-static void add_helperfunc_st (lua_State *L, const task_ops *ops) {
-	lua_pushlightuserdata (L, (void *)ops);
-	lua_pushcclosure (L, task_init, 1);
-}
+/*
+ * starts any missing threads, returns the number of threads running.
+ * subtasks can start a pool from the helpers, so it takes a lock
+ */
+static pthread_mutex_t pools_lock = PTHREAD_MUTEX_INITIALIZER;
 
-static void tasklib_st (lua_State *L, const char *libname, const task_reg *l) {
-	if (libname) {
-		lua_pushstring (L, libname);
-		lua_gettable (L, LUA_GLOBALSINDEX);  /* check whether lib already exists */
-		if (lua_isnil (L, -1)) {  /* no? */
-			lua_pop (L, 1);
-			lua_newtable (L);  /* create it */
-			lua_pushstring (L, libname);
-			lua_pushvalue (L, -2);
-			lua_settable (L, LUA_GLOBALSINDEX);  /* register it with given name */
+static int pool_grow (pool_t *p) {
+	int n;
+	
+	pthread_mutex_lock (&pools_lock);
+	while (p->nthreads < p->size) {
+		thread_t *thrd = (thread_t *)malloc (sizeof (thread_t));
+		if (!thrd)
+			break;
+		thrd->in = &p->q;
+		thrd->out = NULL;
+		thrd->ref_in = thrd->ref_out = LUA_NOREF;
+		thrd->task = NULL;
+		thrd->signal = 0;
+		thrd->yield = 0;
+		thrd->detach = 0;
+		thrd->spawned = 0;
+		if (pthread_create (&thrd->pth, NULL, thread_work, thrd)) {
+			free (thrd);
+			break;
 		}
+		p->threads [p->nthreads++] = thrd;
 	}
-	for (; l->name; l++) {
-		lua_pushstring(L, l->name);
-		add_helperfunc_st (L, l->ops);
-		lua_settable (L, -3);
-	}
+	p->started = 1;
+	n = p->nthreads;
+	pthread_mutex_unlock (&pools_lock);
+	return n;
 }
 
+/* stops and joins all the threads, waking each one with an empty task */
+static void pool_stop (pool_t *p) {
+	int i;
+	
+	for (i = 0; i < p->nthreads; i++)
+		p->threads [i]->signal = 1;
+	q_wakeall (&p->q);
+	for (i = 0; i < p->nthreads; i++) {
+		pthread_join (p->threads [i]->pth, NULL);
+		free (p->threads [i]);
+	}
+	p->nthreads = 0;
+}
 
+static int check_class (lua_State *L, int index) {
+	return luaL_checkoption (L, index, NULL, class_names);
+}
 
-static void signal_task_st (int pause) {
-	thread_t *thrd = (thread_t *)pthread_getspecific (thread_key);
-	task_t *t = thrd->task;
+/*
+ * helper.dispatch (task, out_q)
+ * sends the task to the pool of its class, it will appear in out_q
+ */
+static int pool_dispatch (task_t *t, queue_t *out_q) {
+	int tclass = t->tclass;
+	pool_t *p;
 	
-	pthread_mutex_lock (&t->lock);
+	if (tclass < 0 || tclass >= N_CLASSES)
+		tclass = TASK_IO;
 	
-	q_push (thrd->out, t);
-	if (pause) {
-		t->state = TSK_PAUSED;
-		while (t->state == TSK_PAUSED)
-			pthread_cond_wait (&t->unpaused, &t->lock);
-	}
+	p = &pools [tclass];
+	if (!p->started && pool_grow (p) == 0)
+		return 0;
 	
-	pthread_mutex_unlock (&t->lock);
+	t->out = out_q;
+	tsk_setstate (t, TSK_WAITING);
+	t->queued = now_secs ();
+	q_push (&p->q, t);
+	return 1;
 }
 
-/********************************************
- * null task
- ********************************************/
-static int null_prepare (lua_State *L, void **udata) {
-	*udata = NULL;
+static int dispatch (lua_State *L) {
+	task_t *t = check_task (L, 1);
+	queue_t *out_q = check_queue (L, 2);
+	
+	if (t->state != TSK_READY)
+		luaL_error (L, "task not 'Ready'");
+	if (!pool_dispatch (t, out_q))
+		luaL_error (L, "can't start helper threads");
 	return 0;
 }
 
-static int null_work (void *udata) {
-	return 0;
+/*
+ * helper.poolsize (class [, n])
+ * gets or sets the number of threads for the pool of
+ * the given class ("io", "cpu" or "latency")
+ */
+static int pool_size (lua_State *L) {
+	pool_t *p = &pools [check_class (L, 1)];
+	
+	if (!lua_isnoneornil (L, 2)) {
+		int n = luaL_checkint (L, 2);
+		luaL_argcheck (L, n > 0, 2, "positive number expected");
+		p->size = n < POOL_MAXTHREADS ? n : POOL_MAXTHREADS;
+		if (p->started)
+			pool_grow (p);
+	}
+	
+	lua_pushnumber (L, p->size);
+	return 1;
 }
 
-static int null_update (lua_State *L, void *udata) {
+static int pools_gc (lua_State *L) {
+	int i;
+	for (i = 0; i < N_CLASSES; i++)
+		pool_stop (&pools [i]);
 	return 0;
 }
 
-static task_ops null_task = {
-	null_prepare,
-	null_work,
-	null_update
-};
+static void set_pools (lua_State *L) {
+	long ncpu = sysconf (_SC_NPROCESSORS_ONLN);
+	if (ncpu < 1)
+		ncpu = 1;
+	
+	pool_init (&pools [TASK_IO], ncpu * 4);
+	pool_init (&pools [TASK_CPU], ncpu);
+	pool_init (&pools [TASK_LATENCY], 2);
+	
+	/* the threads are stopped when the state closes, before the library is unloaded */
+	lua_newuserdata (L, 1);
+	lua_newtable (L);
+	lua_pushcfunction (L, pools_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_setmetatable (L, -2);
+	luaL_ref (L, LUA_REGISTRYINDEX);
+}
 
-/**********************************
- * waiter task
- **********************************/
-typedef struct waiter_udata {
+/**************************************************
+ *  coroutine dispatcher
+ **************************************************/
+
+/*
+ * fair queuing: the tasks for a fair queue are held in one FIFO per
+ * flow, and only 'window' of them (usually the number of helpers)
+ * are let into the queue at a time, picked by deficit round-robin.
+ * each flow gets 'weight' tasks per round.
+ */
+typedef struct fairq_t {
 	queue_t *q;
-	task_t *t;
-	struct timespec timeout;
-} waiter_udata;
+	int ref_q;
+	int window, inflight;
+	struct flow_t *active, *last;	/* flows with tasks held, round-robin */
+	struct fairq_t *next;
+} fairq_t;
+
+typedef struct flow_t {
+	fairq_t *fq;
+	double weight, deficit;
+	task_t *head, *tail;			/* held back */
+	int tasks;						/* held and in flight */
+	int ref;						/* keeps the flow while it has tasks */
+	int active;
+	struct flow_t *next;
+} flow_t;
+
+typedef struct coro_t {
+	lua_State *co;
+	int ref_co;						/* keep the coroutine, */
+	int ref_in, ref_anchor;			/* its queue and helper alive */
+	queue_t *in;					/* NULL: tasks go to the shared pools */
+	flow_t *flow;					/* or to a fair queue through this flow */
+	task_t *waiting;				/* the task it's blocked on */
+	int pending;					/* tasks still pointing to this record */
+	int dead;
+	double deadline;
+	int hidx;						/* position in the deadlines heap, -1 if none */
+	int ready;						/* in the ready list */
+	int parked;						/* yielded false, waits for wake() */
+	int slot;						/* its handle, see slot_new() */
+	struct coro_t *prev, *next;
+	struct coro_t *rnext;
+} coro_t;
+
+#define DISP_MAXSPARE	256			/* finished records kept for reuse */
+#define DISP_GENSHIFT	4294967296.0	/* a handle is slot + gen * this */
+#define DISP_MAXGEN		(1 << 20)
+
+typedef struct coro_slot {
+	coro_t *c;						/* NULL if free */
+	int nextfree;
+	unsigned int gen;				/* bumped each time it's freed */
+} coro_slot;
+
+typedef struct dispatcher_t {
+	queue_t *out;
+	int ref_out;
+	int live, parked;
+	coro_t *coros;
+	coro_t *current;				/* being resumed */
+	coro_t **heap;					/* coroutines with a deadline, earliest first */
+	int nheap, heapsize;
+	fairq_t *fairqs;
+	coro_t *ready, *rlast;			/* to be resumed without a task */
+	coro_t *spare;
+	int nspare;
+	coro_slot *slots;
+	int nslots, slotsize, freeslot;
+} dispatcher_t;
+
+static dispatcher_t *check_dispatcher (lua_State *L, int index) {
+	dispatcher_t *d = (dispatcher_t *)luaL_checkudata (L, index, DispatcherType);
+	luaL_argcheck (L, d, index, "dispatcher expected");
+	return d;
+}
 
-static int waiter_prepare (lua_State *L, void **udata) {
-	queue_t *q = check_queue (L, 1);
-	waiter_udata *ud = (waiter_udata *)malloc (sizeof (waiter_udata));
-	if (!ud)
-		luaL_error (L, "can't allocate userdata");
-	*udata = ud;
-	ud->q = q;
-	ud->t = NULL;
+/*
+ * deadlines heap
+ */
+static void dh_set (dispatcher_t *d, int i, coro_t *c) {
+	d->heap [i] = c;
+	c->hidx = i;
+}
+
+static void dh_up (dispatcher_t *d, int i) {
+	coro_t *c = d->heap [i];
 	
-	if (lua_isnoneornil (L, 2)) {
-		ud->timeout.tv_sec = 0;
-		ud->timeout.tv_nsec = 0;
-		
-	} else {
-		
-		struct timeval tv;
-		struct timespec now;
-		
-		lua_Number timeout = lua_tonumber (L, 2);
-		NUMBER_TO_TIMESPEC (timeout, &ud->timeout);
-		
-		gettimeofday (&tv, NULL);
-		TIMEVAL_TO_TIMESPEC (&tv, &now);
-		timeradd (&ud->timeout, &now, &ud->timeout);
+	while (i > 0 && c->deadline < d->heap [(i-1) / 2]->deadline) {
+		dh_set (d, i, d->heap [(i-1) / 2]);
+		i = (i-1) / 2;
 	}
-
-	return 0;
+	dh_set (d, i, c);
 }
 
-static int waiter_work (void *udata) {
-	waiter_udata *ud = (waiter_udata *)udata;
-	
-	if (ud->timeout.tv_sec != 0 || ud->timeout.tv_nsec != 0)
-		ud->t = q_wait (ud->q, NULL);
-	else
-		ud->t = q_wait (ud->q, &ud->timeout);
+static void dh_down (dispatcher_t *d, int i) {
+	coro_t *c = d->heap [i];
+	int child;
 	
-	return 0;
+	while ((child = 2*i + 1) < d->nheap) {
+		if (child+1 < d->nheap && d->heap [child+1]->deadline < d->heap [child]->deadline)
+			child++;
+		if (!(d->heap [child]->deadline < c->deadline))
+			break;
+		dh_set (d, i, d->heap [child]);
+		i = child;
+	}
+	dh_set (d, i, c);
 }
 
-static int waiter_update (lua_State *L, void *udata) {
-	waiter_udata *ud = (waiter_udata *)udata;
-	
-	if (ud->t != NULL)
+static int dh_push (dispatcher_t *d, coro_t *c) {
+	if (d->nheap >= d->heapsize) {
+		int size = d->heapsize ? d->heapsize * 2 : 64;
+		coro_t **heap = (coro_t **)realloc (d->heap, size * sizeof (coro_t *));
+		if (!heap)
+			return 0;
+		d->heap = heap;
+		d->heapsize = size;
+	}
+	d->heap [d->nheap] = c;
+	dh_up (d, d->nheap++);
+	return 1;
+}
+
+static void dh_remove (dispatcher_t *d, coro_t *c) {
+	int i = c->hidx;
+	coro_t *last;
+	
+	if (i < 0)
+		return;
+	
+	c->hidx = -1;
+	last = d->heap [--d->nheap];
+	if (last != c) {
+		dh_set (d, i, last);
+		dh_up (d, i);
+		dh_down (d, last->hidx);
+	}
+}
+
+/*
+ * fair queues
+ */
+static fairq_t *fq_find (dispatcher_t *d, queue_t *q) {
+	fairq_t *fq;
+	
+	for (fq = d->fairqs; fq; fq = fq->next)
+		if (fq->q == q)
+			return fq;
+	return NULL;
+}
+
+static flow_t *to_flow (lua_State *L, int index) {
+	flow_t *f = (flow_t *)lua_touserdata (L, index);
+	int eq = 0;
+	
+	if (f && lua_getmetatable (L, index)) {
+		luaL_getmetatable (L, FlowType);
+		eq = lua_rawequal (L, -1, -2);
+		lua_pop (L, 2);
+	}
+	return eq ? f : NULL;
+}
+
+static flow_t *check_flow (lua_State *L, int index) {
+	flow_t *f = (flow_t *)luaL_checkudata (L, index, FlowType);
+	luaL_argcheck (L, f, index, "flow expected");
+	return f;
+}
+
+static void fq_activate (fairq_t *fq, flow_t *f) {
+	f->next = NULL;
+	if (fq->last)
+		fq->last->next = f;
+	else
+		fq->active = f;
+	fq->last = f;
+}
+
+static flow_t *fq_next (fairq_t *fq) {
+	flow_t *f = fq->active;
+	
+	fq->active = f->next;
+	if (!fq->active)
+		fq->last = NULL;
+	return f;
+}
+
+/* lets tasks into the queue, while the window allows */
+static void fq_pump (fairq_t *fq) {
+	while (fq->inflight < fq->window && fq->active) {
+		flow_t *f = fq->active;
+		task_t *t;
+		
+		if (f->deficit < 1) {
+			f->deficit += f->weight;			/* its turn in a new round */
+			if (f->deficit < 1) {
+				fq_activate (fq, fq_next (fq));
+				continue;
+			}
+		}
+		
+		t = f->head;
+		f->head = t->next;
+		if (!f->head)
+			f->tail = NULL;
+		f->deficit -= 1;
+		
+		if (!f->head) {
+			fq_next (fq);
+			f->active = 0;
+			f->deficit = 0;
+		} else if (f->deficit < 1)
+			fq_activate (fq, fq_next (fq));
+		
+		t->flow = f;
+		fq->inflight++;
+		t->queued = now_secs ();
+		q_push (fq->q, t);
+	}
+}
+
+/* ref_flow is a reference to the flow's userdata */
+static void flow_push (lua_State *L, flow_t *f, int ref_flow, task_t *t) {
+	tsk_setstate (t, TSK_WAITING);
+	t->next = NULL;
+	if (f->tail)
+		f->tail->next = t;
+	else
+		f->head = t;
+	f->tail = t;
+	
+	if (f->tasks++ == 0) {
+		lua_rawgeti (L, LUA_REGISTRYINDEX, ref_flow);
+		f->ref = luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+	if (!f->active) {
+		f->active = 1;
+		fq_activate (f->fq, f);
+	}
+	fq_pump (f->fq);
+}
+
+/* a fair-queued task is done, make room for the next one */
+static void flow_done (lua_State *L, task_t *t) {
+	flow_t *f = t->flow;
+	
+	t->flow = NULL;
+	f->fq->inflight--;
+	if (--f->tasks == 0) {
+		luaL_unref (L, LUA_REGISTRYINDEX, f->ref);
+		f->ref = LUA_NOREF;
+	}
+	fq_pump (f->fq);
+}
+
+/*
+ * handles given to the Lua code for wake() name a slot and its
+ * generation, not the record: records are reused or freed, and a
+ * stale handle has to be told apart instead of waking another one
+ */
+static int slot_new (dispatcher_t *d, coro_t *c) {
+	int i = d->freeslot;
+	
+	if (i >= 0)
+		d->freeslot = d->slots [i].nextfree;
+	else {
+		if (d->nslots >= d->slotsize) {
+			int size = d->slotsize ? d->slotsize * 2 : 64;
+			coro_slot *slots = (coro_slot *)realloc (d->slots, size * sizeof (coro_slot));
+			if (!slots)
+				return 0;
+			d->slots = slots;
+			d->slotsize = size;
+		}
+		i = d->nslots++;
+		d->slots [i].gen = 0;
+	}
+	d->slots [i].c = c;
+	c->slot = i;
+	return 1;
+}
+
+static void slot_free (dispatcher_t *d, coro_t *c) {
+	coro_slot *sl = &d->slots [c->slot];
+	
+	sl->c = NULL;
+	sl->gen = (sl->gen + 1) % DISP_MAXGEN;
+	sl->nextfree = d->freeslot;
+	d->freeslot = c->slot;
+}
+
+static void push_handle (lua_State *L, dispatcher_t *d, coro_t *c) {
+	lua_pushnumber (L, c->slot + d->slots [c->slot].gen * DISP_GENSHIFT);
+}
+
+static coro_t *check_handle (lua_State *L, dispatcher_t *d, int index) {
+	lua_Number h = luaL_checknumber (L, index);
+	lua_Number gen = (lua_Number) (unsigned long) (h / DISP_GENSHIFT);
+	lua_Number i = h - gen * DISP_GENSHIFT;
+	
+	if (h < 0 || i >= d->nslots || !d->slots [(int) i].c || d->slots [(int) i].gen != gen)
+		luaL_argerror (L, index, "stale coroutine handle");
+	return d->slots [(int) i].c;
+}
+
+/*
+ * coroutine records
+ */
+static void coro_free (dispatcher_t *d, coro_t *c) {
+	slot_free (d, c);
+	if (c->prev)
+		c->prev->next = c->next;
+	else
+		d->coros = c->next;
+	if (c->next)
+		c->next->prev = c->prev;
+	
+	if (d->nspare < DISP_MAXSPARE) {
+		c->next = d->spare;
+		d->spare = c;
+		d->nspare++;
+	} else
+		free (c);
+}
+
+static coro_t *coro_new (dispatcher_t *d) {
+	coro_t *c = d->spare;
+	
+	if (c) {
+		d->spare = c->next;
+		d->nspare--;
+	} else
+		c = (coro_t *)malloc (sizeof (coro_t));
+	return c;
+}
+
+/* queues the coroutine to be resumed with no value */
+static void coro_ready (dispatcher_t *d, coro_t *c) {
+	if (c->ready)
+		return;
+	c->ready = 1;
+	c->pending++;
+	c->rnext = NULL;
+	if (d->rlast)
+		d->rlast->rnext = c;
+	else
+		d->ready = c;
+	d->rlast = c;
+}
+
+/* the record stays around while some task still points to it */
+static void coro_kill (lua_State *L, dispatcher_t *d, coro_t *c) {
+	c->dead = 1;
+	c->waiting = NULL;
+	d->live--;
+	if (c->parked) {
+		c->parked = 0;
+		d->parked--;
+	}
+	dh_remove (d, c);
+	
+	luaL_unref (L, LUA_REGISTRYINDEX, c->ref_co);
+	luaL_unref (L, LUA_REGISTRYINDEX, c->ref_in);
+	luaL_unref (L, LUA_REGISTRYINDEX, c->ref_anchor);
+	c->ref_co = c->ref_in = c->ref_anchor = LUA_NOREF;
+	c->co = NULL;
+	
+	if (c->pending == 0)
+		coro_free (d, c);
+}
+
+static void task_unbind (dispatcher_t *d, task_t *t) {
+	coro_t *c = t->owner;
+	
+	if (!c)
+		return;
+	t->owner = NULL;
+	if (--c->pending == 0 && c->dead)
+		coro_free (d, c);
+}
+
+static void task_bind (dispatcher_t *d, task_t *t, coro_t *c) {
+	if (t->owner == c)
+		return;
+	task_unbind (d, t);
+	t->owner = c;
+	c->pending++;
+}
+
+/* nobody waits for it anymore, tells work() to stop soon if it can */
+static void tsk_cancel (task_t *t) {
+	if (t && t->ops && t->ops->cancel)
+		t->ops->cancel (t->udata);
+}
+
+static task_ops batch_ops;
+
+/* finishes a task nobody waits for anymore, discarding any result */
+static void task_dispose (lua_State *L, task_t *t) {
+	int top = lua_gettop (L);
+	int batch = t->ops == &batch_ops;
+	
+	lua_pushcfunction (L, task_update);
+	lua_pushlightuserdata (L, t);
+	if (lua_pcall (L, 1, 1, 0) == 0 && batch && lua_istable (L, -1)) {
+		int i, n = lua_objlen (L, -1);
+		for (i = 1; i <= n; i++) {			/* and the tasks it has done */
+			lua_rawgeti (L, -1, i);
+			task_dispose (L, (task_t *)lua_touserdata (L, -1));
+			lua_pop (L, 1);
+		}
+	}
+	lua_settop (L, top);
+}
+
+static void coro_submit (lua_State *L, dispatcher_t *d, coro_t *c, task_t *t) {
+	task_bind (d, t, c);
+	if (c->flow)
+		flow_push (L, c->flow, c->ref_in, t);
+	else if (c->in) {
+		tsk_setstate (t, TSK_WAITING);
+		t->queued = now_secs ();
+		q_push (c->in, t);
+	} else if (!pool_dispatch (t, d->out))
+		luaL_error (L, "can't start helper threads");
+}
+
+/*
+ * resumes the coroutine with the task (or with nothing, if
+ * it timed out), until it yields a task that can't be done inline.
+ * the coroutine can yield a timeout (in seconds) after the task,
+ * or false to stay parked until dispatcher:wake().  a task that
+ * signals can only get a timeout if it can be cancelled, or it
+ * would keep coming back after being dropped.
+ */
+static void coro_resume (lua_State *L, dispatcher_t *d, coro_t *c, task_t *t) {
+	lua_State *co = c->co;
+	
+	dh_remove (d, c);
+	c->waiting = NULL;
+	
+	do {
+		int status;
+		lua_Number timeout = -1;
+		task_t *t2;
+		
+		if (t)
+			lua_pushlightuserdata (co, t);
+		d->current = c;
+		status = lua_resume (co, t ? 1 : 0);
+		d->current = NULL;
+		
+		if (status != LUA_YIELD) {
+			if (status != 0) {
+				lua_xmove (co, L, 1);		/* error message */
+				coro_kill (L, d, c);
+				lua_error (L);
+			}
+			coro_kill (L, d, c);
+			return;
+		}
+		
+		if (lua_gettop (co) == 0 || lua_isnil (co, 1)) {
+			coro_kill (L, d, c);
+			return;
+		}
+		if (lua_isboolean (co, 1) && !lua_toboolean (co, 1)) {
+			lua_settop (co, 0);
+			c->parked = 1;
+			d->parked++;
+			return;
+		}
+		t2 = is_task (co, 1);
+		if (lua_isnumber (co, 2))
+			timeout = lua_tonumber (co, 2);
+		lua_settop (co, 0);
+		if (!t2) {
+			coro_kill (L, d, c);
+			luaL_error (L, "coroutine yielded a non-task value");
+		}
+		if (timeout >= 0 && tt_signals (t2->tt) && !(t2->ops && t2->ops->cancel)) {
+			coro_kill (L, d, c);
+			luaL_error (L, "a task that signals and can't be cancelled can't have a timeout");
+		}
+		
+		t = NULL;
+		if (t2->state == TSK_READY && tsk_tryinline (t2))
+			t = t2;
+		else {
+			if (t2->state == TSK_READY)
+				coro_submit (L, d, c, t2);
+			else
+				task_bind (d, t2, c);
+			c->waiting = t2;
+			if (timeout >= 0) {
+				c->deadline = now_secs () + timeout;
+				if (!dh_push (d, c))
+					luaL_error (L, "can't alloc deadline");
+			}
+		}
+	} while (t);
+}
+
+/* resumes the coroutines that were ready when called */
+static void coro_runready (lua_State *L, dispatcher_t *d) {
+	coro_t *last = d->rlast;
+	
+	while (d->ready) {
+		coro_t *c = d->ready;
+		
+		d->ready = c->rnext;
+		if (!d->ready)
+			d->rlast = NULL;
+		c->ready = 0;
+		if (!c->dead)
+			coro_resume (L, d, c, NULL);
+		if (--c->pending == 0 && c->dead)
+			coro_free (d, c);
+		if (c == last)
+			break;
+	}
+}
+
+/*
+ * helper.newdispatcher (out_q)
+ */
+static int new_dispatcher (lua_State *L) {
+	queue_t *out_q = check_queue (L, 1);
+	dispatcher_t *d = (dispatcher_t *)lua_newuserdata (L, sizeof (dispatcher_t));
+	
+	d->out = out_q;
+	lua_pushvalue (L, 1);
+	d->ref_out = luaL_ref (L, LUA_REGISTRYINDEX);
+	d->live = d->parked = 0;
+	d->current = NULL;
+	d->coros = NULL;
+	d->heap = NULL;
+	d->nheap = d->heapsize = 0;
+	d->fairqs = NULL;
+	d->ready = d->rlast = NULL;
+	d->spare = NULL;
+	d->nspare = 0;
+	d->slots = NULL;
+	d->nslots = d->slotsize = 0;
+	d->freeslot = -1;
+	
+	luaL_getmetatable (L, DispatcherType);
+	lua_setmetatable (L, -2);
+	return 1;
+}
+
+/*
+ * dispatcher:fairqueue (queue, window)
+ * tasks sent to queue through flows are let in by deficit round-robin,
+ * up to window at a time
+ */
+static int disp_fairqueue (lua_State *L) {
+	dispatcher_t *d = check_dispatcher (L, 1);
+	queue_t *q = check_queue (L, 2);
+	int window = luaL_checkint (L, 3);
+	fairq_t *fq = fq_find (d, q);
+	
+	luaL_argcheck (L, window > 0, 3, "window must be positive");
+	if (!fq) {
+		fq = (fairq_t *)malloc (sizeof (fairq_t));
+		if (!fq)
+			luaL_error (L, "can't alloc fair queue");
+		fq->q = q;
+		lua_pushvalue (L, 2);
+		fq->ref_q = luaL_ref (L, LUA_REGISTRYINDEX);
+		fq->inflight = 0;
+		fq->active = fq->last = NULL;
+		fq->next = d->fairqs;
+		d->fairqs = fq;
+	}
+	fq->window = window;
+	fq_pump (fq);
+	return 0;
+}
+
+/*
+ * dispatcher:newflow (queue [, weight])
+ * a flow into a fair queue, to pass to spawn() instead of the queue
+ */
+static int disp_newflow (lua_State *L) {
+	dispatcher_t *d = check_dispatcher (L, 1);
+	fairq_t *fq = fq_find (d, check_queue (L, 2));
+	lua_Number weight = luaL_optnumber (L, 3, 1);
+	flow_t *f;
+	
+	if (!fq)
+		luaL_error (L, "not a fair queue");
+	luaL_argcheck (L, weight > 0, 3, "weight must be positive");
+	
+	f = (flow_t *)lua_newuserdata (L, sizeof (flow_t));
+	f->fq = fq;
+	f->weight = weight;
+	f->deficit = 0;
+	f->head = f->tail = NULL;
+	f->tasks = 0;
+	f->ref = LUA_NOREF;
+	f->active = 0;
+	f->next = NULL;
+	
+	luaL_getmetatable (L, FlowType);
+	lua_setmetatable (L, -2);
+	return 1;
+}
+
+/*
+ * flow:weight ([w])
+ * returns the weight, after setting it to w if given
+ */
+static int flow_weight (lua_State *L) {
+	flow_t *f = check_flow (L, 1);
+	
+	if (!lua_isnoneornil (L, 2)) {
+		lua_Number w = luaL_checknumber (L, 2);
+		luaL_argcheck (L, w > 0, 2, "weight must be positive");
+		f->weight = w;
+	}
+	lua_pushnumber (L, f->weight);
+	return 1;
+}
+
+/*
+ * dispatcher:spawn (co, task, queue [, anchor])
+ * adds the coroutine, to be resumed when the task is done, or
+ * on the next round if task is nil.
+ * its tasks go to queue, or to the shared pools if queue is true,
+ * or to a fair queue if it's a flow.
+ * anchor is kept alive as long as the coroutine (usually its helper)
+ */
+static int disp_spawn (lua_State *L) {
+	dispatcher_t *d = check_dispatcher (L, 1);
+	lua_State *co = lua_tothread (L, 2);
+	task_t *t = lua_isnil (L, 3) ? NULL : check_task (L, 3);
+	queue_t *in_q = NULL;
+	flow_t *f = NULL;
+	coro_t *c;
+	
+	luaL_argcheck (L, co, 2, "coroutine expected");
+	if ((f = to_flow (L, 4)) != NULL)
+		in_q = f->fq->q;
+	else if (!lua_isboolean (L, 4))
+		in_q = check_queue (L, 4);
+	if (t && t->state != TSK_READY)
+		luaL_error (L, "task not 'Ready'");
+	
+	c = coro_new (d);
+	if (!c)
+		luaL_error (L, "can't alloc coroutine record");
+	if (!slot_new (d, c)) {
+		free (c);
+		luaL_error (L, "can't alloc coroutine handle");
+	}
+	c->co = co;
+	c->in = in_q;
+	c->flow = f;
+	c->waiting = NULL;
+	c->pending = 0;
+	c->dead = 0;
+	c->hidx = -1;
+	c->ready = 0;
+	c->parked = 0;
+	lua_pushvalue (L, 2);
+	c->ref_co = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_pushvalue (L, 4);
+	c->ref_in = luaL_ref (L, LUA_REGISTRYINDEX);
+	lua_pushvalue (L, 5);
+	c->ref_anchor = luaL_ref (L, LUA_REGISTRYINDEX);
+	
+	c->prev = NULL;
+	c->next = d->coros;
+	if (d->coros)
+		d->coros->prev = c;
+	d->coros = c;
+	d->live++;
+	
+	if (t)
+		coro_submit (L, d, c, t);
+	else
+		coro_ready (d, c);
+	return 0;
+}
+
+/*
+ * dispatcher:current ()
+ * handle of the running coroutine, for wake(); nil outside of them
+ */
+static int disp_current (lua_State *L) {
+	dispatcher_t *d = check_dispatcher (L, 1);
+	
+	if (!d->current)
+		return 0;
+	push_handle (L, d, d->current);
+	return 1;
+}
+
+/*
+ * dispatcher:wake (handle)
+ * a coroutine that yielded false will be resumed on the next round
+ */
+static int disp_wake (lua_State *L) {
+	dispatcher_t *d = check_dispatcher (L, 1);
+	coro_t *c = check_handle (L, d, 2);
+	
+	if (!c->parked)
+		luaL_error (L, "coroutine isn't parked");
+	c->parked = 0;
+	d->parked--;
+	coro_ready (d, c);
+	return 0;
+}
+
+/*
+ * dispatcher:run ([timeout])
+ * resumes each coroutine as its tasks appear in the output queue,
+ * or when its deadline passes. returns true when all of them are
+ * finished or parked, or nothing if timeout seconds pass first
+ */
+static int disp_run (lua_State *L) {
+	dispatcher_t *d = check_dispatcher (L, 1);
+	double until = -1;
+	
+	if (!lua_isnoneornil (L, 2))
+		until = now_secs () + luaL_checknumber (L, 2);
+	
+	while (d->live > d->parked) {
+		double wake = until;
+		coro_t *c;
+		task_t *t;
+		
+		coro_runready (L, d);
+		if (d->live == d->parked)
+			break;
+		
+		if (d->nheap > 0) {
+			c = d->heap [0];
+			if (c->deadline <= now_secs ()) {
+				task_unbind (d, c->waiting);	/* it will be disposed when it arrives */
+				tsk_cancel (c->waiting);
+				coro_resume (L, d, c, NULL);
+				continue;
+			}
+			if (wake < 0 || c->deadline < wake)
+				wake = c->deadline;
+		}
+		
+		if (d->ready)
+			t = q_pop (d->out);
+		else if (wake < 0)
+			t = q_wait (d->out, NULL);
+		else {
+			struct timespec ts;
+			abs_timeout (wake - now_secs (), &ts);
+			t = q_wait (d->out, &ts);
+		}
+		
+		if (!t) {
+			if (until >= 0 && now_secs () >= until)
+				return 0;
+			continue;
+		}
+		
+		if (t->flow && t->state == TSK_DONE)
+			flow_done (L, t);
+		c = t->owner;
+		if (!c || c->dead) {
+			task_unbind (d, t);
+			task_dispose (L, t);
+			continue;
+		}
+		if (t->state == TSK_DONE)
+			task_unbind (d, t);
+		coro_resume (L, d, c, t);
+	}
+	
+	lua_pushboolean (L, 1);
+	return 1;
+}
+
+/*
+ * dispatcher:count ()
+ */
+static int disp_count (lua_State *L) {
+	dispatcher_t *d = check_dispatcher (L, 1);
+	lua_pushnumber (L, d->live);
+	return 1;
+}
+
+/*
+ * dispatcher:__gc ()
+ */
+static int disp_gc (lua_State *L) {
+	dispatcher_t *d = check_dispatcher (L, 1);
+	
+	while (d->coros) {
+		coro_t *c = d->coros;
+		if (!c->dead)
+			coro_kill (L, d, c);
+		if (d->coros == c)
+			coro_free (d, c);
+	}
+	while (d->spare) {
+		coro_t *c = d->spare;
+		d->spare = c->next;
+		free (c);
+	}
+	while (d->fairqs) {
+		fairq_t *fq = d->fairqs;
+		d->fairqs = fq->next;
+		luaL_unref (L, LUA_REGISTRYINDEX, fq->ref_q);
+		free (fq);
+	}
+	free (d->heap);
+	free (d->slots);
+	luaL_unref (L, LUA_REGISTRYINDEX, d->ref_out);
+	return 0;
+}
+
+/**********************************
+ * batch task
+ **********************************/
+typedef struct batch_udata {
+	int n;
+	task_t **sub;
+} batch_udata;
+
+static int batch_work (void *udata) {
+	batch_udata *ud = (batch_udata *)udata;
+	int i;
+	
+	for (i = 0; i < ud->n; i++) {
+		tsk_setstate (ud->sub [i], TSK_BUSY);
+		tsk_worksync (ud->sub [i]);		/* the helper's task is the batch */
+		tsk_setstate (ud->sub [i], TSK_DONE);
+	}
+	return 0;
+}
+
+static int batch_update (lua_State *L, void *udata) {
+	batch_udata *ud = (batch_udata *)udata;
+	int i;
+	
+	lua_createtable (L, ud->n, 0);
+	for (i = 0; i < ud->n; i++) {
+		lua_pushlightuserdata (L, ud->sub [i]);
+		lua_rawseti (L, -2, i+1);
+	}
+	free (ud);
+	return 1;
+}
+
+static task_ops batch_ops = {
+	NULL,
+	batch_work,
+	batch_update
+};
+
+static tasktype_t batch_type = {&batch_ops, PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * helper.batch (tasks)
+ * a task that does the work of all the (one-shot, 'Ready') tasks in the
+ * given array in a single trip to a helper. helper.update() returns
+ * the same array, each task is then 'Done' and has to be updated.
+ * each work() is run as if by the Lua thread, see tsk_worksync().
+ */
+static int new_batch (lua_State *L) {
+	int i, n, tclass = -1;
+	batch_udata *ud;
+	task_t *t;
+	
+	luaL_checktype (L, 1, LUA_TTABLE);
+	n = lua_objlen (L, 1);
+	for (i = 1; i <= n; i++) {
+		task_t *sub;
+		lua_rawgeti (L, 1, i);
+		sub = is_task (L, -1);
+		lua_pop (L, 1);
+		if (!sub || sub->state != TSK_READY || tt_signals (sub->tt))
+			luaL_error (L, "item %d isn't a 'Ready' one-shot task", i);
+		if (tclass < 0 || sub->tclass == TASK_IO)
+			tclass = sub->tclass;
+	}
+	
+	ud = (batch_udata *)malloc (sizeof (batch_udata) + n * sizeof (task_t *));
+	if (!ud)
+		luaL_error (L, "can't alloc batch");
+	ud->n = n;
+	ud->sub = (task_t **)(ud + 1);
+	for (i = 0; i < n; i++) {
+		lua_rawgeti (L, 1, i+1);
+		ud->sub [i] = (task_t *)lua_touserdata (L, -1);
+		lua_pop (L, 1);
+		tsk_setstate (ud->sub [i], TSK_WAITING);
+	}
+	
+	t = new_task (L);
+	t->tt = &batch_type;
+	t->ops = &batch_ops;
+	t->tclass = tclass < 0 ? TASK_CPU : tclass;
+	t->udata = ud;
+	tsk_setstate (t, TSK_READY);
+	return 1;
+}
+
+static const struct luaL_reg queue_meths [] = {
+	{"addtask", queue_addtask},
+	{"remove", queue_removetask},
+	{"peek", queue_peek},
+	{"wait", queue_wait},
+	{"__gc", queue_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg thread_meths [] = {
+	{"currenttask", currenttask},
+	{"queues", thread_queues},
+	{"__gc", thread_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg dispatcher_meths [] = {
+	{"spawn", disp_spawn},
+	{"run", disp_run},
+	{"count", disp_count},
+	{"current", disp_current},
+	{"wake", disp_wake},
+	{"fairqueue", disp_fairqueue},
+	{"newflow", disp_newflow},
+	{"__gc", disp_gc},
+	{NULL, NULL}
+};
+static const struct luaL_reg flow_meths [] = {
+	{"weight", flow_weight},
+	{NULL, NULL}
+};
+static const struct luaL_reg helper_funcs [] = {
+	{"update", task_update},
+	{"state", state},
+	{"tryinline", try_inline},
+	{"now", now},
+	{"batch", new_batch},
+	{"newqueue", new_queue},
+	{"newthread", new_thread},
+	{"newdispatcher", new_dispatcher},
+	{"dispatch", dispatch},
+	{"poolsize", pool_size},
+	{NULL, NULL}
+};
+
+/************************************************
+ * C API
+ ***********************************************/
+static int task_init (lua_State *L) {
+	int ret = 0;
+	
+	tasktype_t *tt = (tasktype_t *)lua_touserdata (L, lua_upvalueindex (1));
+	const task_ops *ops = tt->ops;
+	task_t *t = new_task (L);
+	t->tt = tt;
+	t->ops = ops;
+	if (ops)
+		t->tclass = ops->tclass;
+	if (ops && ops->prepare)
+		ret = ops->prepare (L, &t->udata);
+	tsk_setstate (t, TSK_READY);
+	return ret+1;
+}
+
+/* type records are never freed, like the (static) ops they describe */
+static void add_helperfunc_st (lua_State *L, const task_ops *ops) {
+	tasktype_t *tt = (tasktype_t *)malloc (sizeof (tasktype_t));
+	if (!tt)
+		luaL_error (L, "can't alloc task type");
+	
+	tt->ops = ops;
+	pthread_mutex_init (&tt->lock, NULL);
+	tt->cost = 0;
+	tt->runs = 0;
+	tt->signals = 0;
+	tt->detaches = 0;
+	
+	lua_pushlightuserdata (L, tt);
+	lua_pushcclosure (L, task_init, 1);
+}
+
+static void tasklib_st (lua_State *L, const char *libname, const task_reg *l) {
+	if (libname) {
+		lua_pushstring (L, libname);
+		lua_gettable (L, LUA_GLOBALSINDEX);  /* check whether lib already exists */
+		if (lua_isnil (L, -1)) {  /* no? */
+			lua_pop (L, 1);
+			lua_newtable (L);  /* create it */
+			lua_pushstring (L, libname);
+			lua_pushvalue (L, -2);
+			lua_settable (L, LUA_GLOBALSINDEX);  /* register it with given name */
+		}
+	}
+	for (; l->name; l++) {
+		lua_pushstring(L, l->name);
+		add_helperfunc_st (L, l->ops);
+		lua_settable (L, -3);
+	}
+}
+
+
+
+/*
+ * puts the current task in the output queue; with pause, waits there
+ * until it's updated.  when work() is run by the Lua thread there's
+ * nobody to tell, it just returns.
+ */
+static void signal_task_st (int pause) {
+	thread_t *thrd = (thread_t *)pthread_getspecific (thread_key);
+	task_t *t;
+	
+	if (pthread_getspecific (sync_key) || !thrd || !thrd->task)
+		return;
+	
+	t = thrd->task;
+	tt_signal (t->tt);
+	
+	pthread_mutex_lock (&t->lock);
+	
+	if (!t->posted) {
+		t->posted = 1;
+		q_push (tsk_out (thrd, t), t);
+	}
+	if (pause) {
+		t->state = TSK_PAUSED;
+		while (t->state == TSK_PAUSED)
+			pthread_cond_wait (&t->unpaused, &t->lock);
+	}
+	
+	pthread_mutex_unlock (&t->lock);
+}
+
+/*
+ * marks the current task to be continued after its next update.
+ * the work callback should return right after calling this; the
+ * helper is released and the task is requeued on its input queue
+ * when updated, so work() is called again (maybe on another helper)
+ * and has to pick up from whatever state it left in its udata.
+ * when work() is run by the Lua thread, it's just called again, until
+ * it returns without yielding.
+ */
+static void yield_task_st (void) {
+	thread_t *thrd = (thread_t *)pthread_getspecific (thread_key);
+	sync_run *run = (sync_run *)pthread_getspecific (sync_key);
+	
+	if (run)
+		run->yielded = 1;
+	else if (thrd && thrd->task) {
+		tt_signal (thrd->task->tt);
+		thrd->yield = 1;
+	}
+}
+
+/*
+ * hands the current task over to some other thread (or event source).
+ * the helper is released as soon as work() returns, and the task
+ * only appears again in the output queue when complete_task() is
+ * called with the returned handle. work() must call this before
+ * making the handle visible to anybody else.
+ * when work() is run by the Lua thread it returns NULL, and
+ * work() has to do the job itself before returning, since the task is
+ * 'Done' right after.  it's never run again, so nothing is done twice;
+ * helper.tryinline() just won't pick this task type again.
+ */
+static void *detach_task_st (void) {
+	thread_t *thrd = (thread_t *)pthread_getspecific (thread_key);
+	sync_run *run = (sync_run *)pthread_getspecific (sync_key);
+	task_t *t;
+	
+	if (run)
+		run->detached = 1;
+	if (run || !thrd || !thrd->task)
+		return NULL;
+	
+	t = thrd->task;
+	tt_detach (t->tt);
+	t->out = tsk_out (thrd, t);
+	thrd->detach = 1;
+	return t;
+}
+
+/*
+ * can be called from any thread for a detached task.
+ * if done is zero, signals the Lua code like signal_task (0),
+ * else the task is 'Done' and the handle is no longer valid.
+ */
+static void complete_task_st (void *task, int done) {
+	task_t *t = (task_t *)task;
+	
+	if (!t)
+		return;
+	tsk_post (t, t->out, done ? TSK_DONE : TSK_BUSY);
+}
+
+/*
+ * subtasks are jobs spawned by a task's work(), run by the helpers of
+ * the pool of its class without going through Lua.  the task is
+ * detached, and completed when both its work() and all the subtasks
+ * have returned.  subtasks can spawn more; they count for the same
+ * parent task.
+ */
+typedef struct subtask_t {
+	task_t t;						/* only what thread_work() needs */
+	task_t *parent;					/* NULL for post_job() */
+	int (*work) (void *arg);
+	void *arg;
+} subtask_t;
+
+static void subtask_release (task_t *t) {
+	int n;
+	
+	pthread_mutex_lock (&t->lock);
+	n = --t->children;
+	pthread_mutex_unlock (&t->lock);
+	if (n == 0)
+		complete_task_st (t, 1);
+}
+
+static int subtask_work (void *udata) {
+	subtask_t *s = (subtask_t *)udata;
+	task_t *parent = s->parent;
+	
+	detach_task_st ();
+	s->work (s->arg);
+	pthread_cond_destroy (&s->t.unpaused);
+	pthread_mutex_destroy (&s->t.lock);
+	free (s);
+	if (parent)
+		subtask_release (parent);
+	return 0;
+}
+
+static const task_ops subtask_ops = {
+	NULL,
+	subtask_work,
+	NULL
+};
+
+static subtask_t *subtask_new (pool_t *p, int tclass, int (*work) (void *arg), void *arg) {
+	subtask_t *s;
+	
+	if (!p->started && pool_grow (p) == 0)
+		return NULL;
+	s = (subtask_t *)malloc (sizeof (subtask_t));
+	if (!s)
+		return NULL;
+	
+	memset (&s->t, 0, sizeof (s->t));
+	s->t.ops = &subtask_ops;
+	s->t.udata = s;
+	s->t.tclass = tclass;
+	s->t.state = TSK_WAITING;
+	pthread_mutex_init (&s->t.lock, NULL);
+	pthread_cond_init (&s->t.unpaused, NULL);
+	s->parent = NULL;
+	s->work = work;
+	s->arg = arg;
+	return s;
+}
+
+static int post_job_st (int (*work) (void *arg), void *arg);
+
+/*
+ * called from work(), queues work (arg) for the helpers.
+ * if it can't, or work() is run by the Lua thread, runs it right away.
+ * from a post_job() job there's no task to count it for, so it's
+ * posted as another job.
+ */
+static void spawn_subtask_st (int (*work) (void *arg), void *arg) {
+	thread_t *thrd = (thread_t *)pthread_getspecific (thread_key);
+	task_t *parent;
+	subtask_t *s;
+	pool_t *p;
+	
+	if (pthread_getspecific (sync_key) || !thrd || !thrd->task) {
+		work (arg);
+		return;
+	}
+	
+	parent = thrd->task;
+	if (parent->ops == &subtask_ops)
+		parent = ((subtask_t *)parent)->parent;
+	if (!parent) {
+		if (!post_job_st (work, arg))
+			work (arg);
+		return;
+	}
+	
+	p = &pools [parent->tclass >= 0 && parent->tclass < N_CLASSES ? parent->tclass : TASK_IO];
+	s = subtask_new (p, parent->tclass, work, arg);
+	if (!s) {
+		work (arg);
+		return;
+	}
+	
+	if (thrd->task == parent && !thrd->spawned) {
+		detach_task_st ();
+		thrd->spawned = 1;
+		pthread_mutex_lock (&parent->lock);
+		parent->children++;			/* held until work() returns */
+		pthread_mutex_unlock (&parent->lock);
+	}
+	pthread_mutex_lock (&parent->lock);
+	parent->children++;
+	pthread_mutex_unlock (&parent->lock);
+	
+	s->parent = parent;
+	q_push (&p->q, &s->t);
+}
+
+/*
+ * queues work (arg) for the helpers of the I/O pool, on its own: no
+ * task waits for it.  can be called from any thread, returns 0 if it
+ * can't be queued.
+ */
+static int post_job_st (int (*work) (void *arg), void *arg) {
+	pool_t *p = &pools [TASK_IO];
+	subtask_t *s = subtask_new (p, TASK_IO, work, arg);
+	
+	if (!s)
+		return 0;
+	q_push (&p->q, &s->t);
+	return 1;
+}
+
+/********************************************
+ * null task
+ ********************************************/
+typedef struct null_udata {
+	int yields;
+	int runs;
+} null_udata;
+
+static int null_prepare (lua_State *L, void **udata) {
+	null_udata *ud;
+	
+	*udata = NULL;
+	if (!lua_isnumber (L, 1))			/* the task is on top */
+		return 0;
+	
+	ud = (null_udata *)malloc (sizeof (null_udata));
+	if (!ud)
+		luaL_error (L, "can't allocate userdata");
+	*udata = ud;
+	ud->yields = (int) lua_tonumber (L, 1);
+	ud->runs = 0;
+	return 0;
+}
+
+static int null_work (void *udata) {
+	null_udata *ud = (null_udata *)udata;
+	
+	if (ud && ud->runs++ < ud->yields)
+		yield_task_st ();
+	return 0;
+}
+
+static int null_update (lua_State *L, void *udata) {
+	null_udata *ud = (null_udata *)udata;
+	
+	if (!ud)
+		return 0;
+	lua_pushnumber (L, ud->runs);
+	if (ud->runs > ud->yields)
+		free (ud);
+	return 1;
+}
+
+static task_ops null_task = {
+	null_prepare,
+	null_work,
+	null_update,
+	NULL,
+	TASK_LATENCY
+};
+
+/**********************************
+ * waiter task
+ **********************************/
+typedef struct waiter_udata {
+	queue_t *q;
+	task_t *t;
+	int has_timeout;
+	struct timespec timeout;
+} waiter_udata;
+
+static int waiter_prepare (lua_State *L, void **udata) {
+	queue_t *q = check_queue (L, 1);
+	waiter_udata *ud = (waiter_udata *)malloc (sizeof (waiter_udata));
+	if (!ud)
+		luaL_error (L, "can't allocate userdata");
+	*udata = ud;
+	ud->q = q;
+	ud->t = NULL;
+	
+	ud->has_timeout = !lua_isnoneornil (L, 2);
+	if (ud->has_timeout)
+		abs_timeout (lua_tonumber (L, 2), &ud->timeout);
+
+	return 0;
+}
+
+static int waiter_work (void *udata) {
+	waiter_udata *ud = (waiter_udata *)udata;
+	
+	ud->t = q_wait (ud->q, ud->has_timeout ? &ud->timeout : NULL);
+	
+	return 0;
+}
+
+static int waiter_update (lua_State *L, void *udata) {
+	waiter_udata *ud = (waiter_udata *)udata;
+	
+	if (ud->t != NULL)
 		lua_pushlightuserdata (L, ud->t);
 	else
 		lua_pushnil (L);
@@ -781,6 +2392,26 @@ static void setCAPI (lua_State *L) {
 	lua_pushlightuserdata (L, (void *)signal_task_st);
 	lua_settable (L, -3);
 	
+	lua_pushliteral (L, "yield_task");
+	lua_pushlightuserdata (L, (void *)yield_task_st);
+	lua_settable (L, -3);
+	
+	lua_pushliteral (L, "detach_task");
+	lua_pushlightuserdata (L, (void *)detach_task_st);
+	lua_settable (L, -3);
+	
+	lua_pushliteral (L, "complete_task");
+	lua_pushlightuserdata (L, (void *)complete_task_st);
+	lua_settable (L, -3);
+	
+	lua_pushliteral (L, "spawn_subtask");
+	lua_pushlightuserdata (L, (void *)spawn_subtask_st);
+	lua_settable (L, -3);
+	
+	lua_pushliteral (L, "post_job");
+	lua_pushlightuserdata (L, (void *)post_job_st);
+	lua_settable (L, -3);
+	
 	lua_settable (L, -3);
 }
 
@@ -788,6 +2419,8 @@ int luaopen_helper (lua_State *L);
 int luaopen_helper (lua_State *L)
 {
 	pthread_key_create (&thread_key, NULL);
+	pthread_key_create (&sync_key, NULL);
+	set_pools (L);
 	
 	luaL_newmetatable(L, QueueType);
 	lua_pushliteral(L, "__index");
@@ -801,6 +2434,18 @@ int luaopen_helper (lua_State *L)
 	lua_rawset(L, -3);
 	luaL_openlib (L, NULL, thread_meths, 0);
 	
+	luaL_newmetatable(L, DispatcherType);
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -3);
+	luaL_openlib (L, NULL, dispatcher_meths, 0);
+	
+	luaL_newmetatable(L, FlowType);
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -3);
+	luaL_openlib (L, NULL, flow_meths, 0);
+	
 	luaL_openlib (L, "helper", helper_funcs, 0);
 	set_tasks (L);
 	set_info (L);
@@ -4,10 +4,18 @@
  * $Id: helper.h,v 1.7 2007-07-31 23:53:33 jguerra Exp $
  */
 
+/* task classes, each one is run by its own shared pool */
+#define TASK_IO			0		/* blocks on I/O, the default */
+#define TASK_CPU		1		/* compute-bound */
+#define TASK_LATENCY	2		/* short, should never wait behind the others */
+
 typedef struct task_ops {
 	int (*prepare) (lua_State *L, void **udata);
 	int (*work) (void *udata);
 	int (*update) (lua_State *L, void *udata);
+	int (*try_inline) (void *udata);
+	int tclass;
+	void (*cancel) (void *udata);
 } task_ops;
 
 typedef struct task_reg {
@@ -19,10 +27,20 @@ typedef struct task_reg {
 typedef void (*add_helperfunc_t) (lua_State *L, const task_ops *ops);
 typedef void (*tasklib_t) (lua_State *L, const char *libname, const task_reg *l);
 typedef void (*signal_task_t) (int );
+typedef void (*yield_task_t) (void);
+typedef void *(*detach_task_t) (void);
+typedef void (*complete_task_t) (void *task, int done);
+typedef void (*spawn_subtask_t) (int (*work) (void *arg), void *arg);
+typedef int (*post_job_t) (int (*work) (void *arg), void *arg);
 
 add_helperfunc_t add_helperfunc;
 tasklib_t tasklib;
 signal_task_t signal_task;
+yield_task_t yield_task;
+detach_task_t detach_task;
+complete_task_t complete_task;
+spawn_subtask_t spawn_subtask;
+post_job_t post_job;
 
 
 
@@ -38,5 +56,20 @@ signal_task_t signal_task;
 		lua_pop (L, 1);													\
 		lua_getfield (L, -1, "signal_task");								\
 		signal_task = (signal_task_t) lua_touserdata (L, -1);			\
+		lua_pop (L, 1);													\
+		lua_getfield (L, -1, "yield_task");								\
+		yield_task = (yield_task_t) lua_touserdata (L, -1);				\
+		lua_pop (L, 1);													\
+		lua_getfield (L, -1, "detach_task");								\
+		detach_task = (detach_task_t) lua_touserdata (L, -1);			\
+		lua_pop (L, 1);													\
+		lua_getfield (L, -1, "complete_task");							\
+		complete_task = (complete_task_t) lua_touserdata (L, -1);		\
+		lua_pop (L, 1);													\
+		lua_getfield (L, -1, "spawn_subtask");							\
+		spawn_subtask = (spawn_subtask_t) lua_touserdata (L, -1);		\
+		lua_pop (L, 1);													\
+		lua_getfield (L, -1, "post_job");								\
+		post_job = (post_job_t) lua_touserdata (L, -1);					\
 		lua_pop (L, 3);													\
 	}
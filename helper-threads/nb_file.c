@@ -4,20 +4,42 @@
  * $Id: nb_file.c,v 1.6 2007-07-31 23:53:34 jguerra Exp $
  */
  
+#define _GNU_SOURCE
 #include <stdlib.h>
+#include <limits.h>
 #include <string.h>
 #include <stdio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <time.h>
+#include <pthread.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#include <sys/syscall.h>
+#endif
+
+#ifdef NB_FILE_URING
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <linux/io_uring.h>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
 
 
 #include "helper.h"
+#include "nb_file.h"
 
 /**********************************
 ** buffer handling
 ***********************************/
-static const size_t BUF_GLOBSIZE = 1024;
 typedef struct buffer_t {
 	unsigned char *data;
 	unsigned char *end;
@@ -59,13 +81,6 @@ static size_t buffer_resize (buffer_t *b, size_t size) {
 	return b->bufsize;
 }
 
-static void buffer_addchar (buffer_t *b, const char c) {
-	if (buffer_len (b) >= b->bufsize)
-		buffer_resize (b, buffer_len (b) + BUF_GLOBSIZE);
-	
-	*b->end++ = c;
-}
-
 static void buffer_add (buffer_t *b, const char *data, size_t len) {
 	buffer_resize (b, buffer_len (b) + len);
 	
@@ -113,6 +128,427 @@ static FILE *tofile (lua_State *L, int findex) {
 	return *f;
 }
 
+/******************************************
+ **  io_uring backend
+ ******************************************/
+
+/*
+ * a request to the ring, kept in the task's udata.
+ * res is the number of bytes transferred, or -errno
+ */
+typedef struct uring_req {
+	void *task;
+	int op, fd;
+	off_t off;						/* -1: at the current file position */
+	unsigned char *buf;				/* reads */
+	struct iovec *iov;				/* writes: the pieces still to go */
+	int niov;
+	size_t len, done;
+	int res;
+} uring_req;
+
+/* skips the first n bytes of an iovec array */
+static void iov_advance (struct iovec **iov, int *niov, size_t n) {
+	while (*niov > 0 && n >= (*iov)->iov_len) {
+		n -= (*iov)->iov_len;
+		(*iov)++;
+		(*niov)--;
+	}
+	if (*niov > 0 && n > 0) {
+		(*iov)->iov_base = (char *)(*iov)->iov_base + n;
+		(*iov)->iov_len -= n;
+	}
+}
+
+/*
+ * writes all the pieces, at off or (if it's -1) at the current
+ * position.  returns the number of bytes written, or -errno
+ */
+static ssize_t fd_writev (int fd, struct iovec *iov, int niov, off_t off) {
+	size_t done = 0;
+	
+	while (niov > 0) {
+		int cnt = niov < IOV_MAX ? niov : IOV_MAX;
+		ssize_t n = off < 0 ? writev (fd, iov, cnt) : pwritev (fd, iov, cnt, off + done);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -errno;
+		done += n;
+		iov_advance (&iov, &niov, n);
+	}
+	return done;
+}
+
+#ifdef NB_FILE_URING
+
+/*
+ * reads and writes are queued in the submission ring by the helpers,
+ * which then detach their tasks and go on.  a single service thread
+ * submits whatever was queued each time it's woken (one syscall for
+ * the whole batch), and completes the tasks as the kernel finishes
+ * them.  if the ring can't be set up, or it's full, the helper does
+ * the operation itself.  if io_uring_enter() keeps failing, the
+ * service backs off, and then gives up the ring: whatever is queued
+ * is done by the service thread, and the helpers do the rest.
+ */
+#define URING_ENTRIES	256
+#define URING_MAXFAILS	8				/* io_uring_enter() errors in a row */
+#define URING_MAXBACKOFF	128				/* ms */
+
+static struct {
+	int running, stop;
+	int stalled;					/* the ring is given up */
+	int fd, efd;
+	pthread_t pth;
+	pthread_mutex_t lock;
+	unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+	unsigned *cq_head, *cq_tail, *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	void *sq_ptr, *cq_ptr;
+	size_t sq_size, cq_size, sqes_size;
+	unsigned entries;
+	unsigned queued;				/* in the ring, not yet submitted */
+	unsigned inflight;				/* submitted, not yet completed */
+} ur;
+
+/* adds the request to the submission ring, with the lock held */
+static void uring_queue (uring_req *req) {
+	unsigned tail = *ur.sq_tail;
+	unsigned idx = tail & *ur.sq_mask;
+	struct io_uring_sqe *sqe = &ur.sqes [idx];
+	
+	memset (sqe, 0, sizeof (*sqe));
+	sqe->opcode = req->op;
+	sqe->fd = req->fd;
+	if (req->op == IORING_OP_WRITEV) {
+		sqe->addr = (unsigned long) req->iov;
+		sqe->len = req->niov < IOV_MAX ? req->niov : IOV_MAX;
+	} else {
+		sqe->addr = (unsigned long) (req->buf + req->done);
+		sqe->len = req->len - req->done;
+	}
+	sqe->off = req->off < 0 ? (__u64) -1 : (__u64) (req->off + req->done);
+	sqe->user_data = (unsigned long) req;
+	ur.sq_array [idx] = idx;
+	__atomic_store_n (ur.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ur.queued++;
+}
+
+/*
+ * called from work(), after detaching the task.
+ * returns 0 if the ring isn't available or it's full
+ */
+static int uring_submit (uring_req *req) {
+	int wake;
+	
+	pthread_mutex_lock (&ur.lock);
+	if (!ur.running || ur.stalled || ur.queued + ur.inflight >= ur.entries) {
+		pthread_mutex_unlock (&ur.lock);
+		return 0;
+	}
+	wake = (ur.queued == 0);
+	uring_queue (req);
+	pthread_mutex_unlock (&ur.lock);
+	
+	if (wake) {
+		__u64 one = 1;
+		if (write (ur.efd, &one, sizeof (one)) < 0)
+			return 1;				/* the counter is already set */
+	}
+	return 1;
+}
+
+/* does the (rest of the) request in this thread */
+static void uring_sync (uring_req *req) {
+	off_t off = req->off < 0 ? -1 : req->off + (off_t) req->done;
+	ssize_t n;
+	
+	if (req->op == IORING_OP_READ) {
+		do
+			n = off < 0 ? read (req->fd, req->buf + req->done, req->len - req->done)
+					: pread (req->fd, req->buf + req->done, req->len - req->done, off);
+		while (n < 0 && errno == EINTR);
+		if (n < 0)
+			n = -errno;
+	} else
+		n = fd_writev (req->fd, req->iov, req->niov, off);
+	req->res = n < 0 ? (int) n : (int) (req->done + n);
+}
+
+static void uring_reap (void) {
+	unsigned head = *ur.cq_head;
+	unsigned tail = __atomic_load_n (ur.cq_tail, __ATOMIC_ACQUIRE);
+	unsigned n = 0;
+	
+	while (head != tail) {
+		struct io_uring_cqe *cqe = &ur.cqes [head & *ur.cq_mask];
+		uring_req *req = (uring_req *)(unsigned long) cqe->user_data;
+		int res = cqe->res;
+		head++;
+		n++;
+		
+		/* a short write goes back for the rest */
+		if (req->op == IORING_OP_WRITEV && res > 0 && req->done + res < req->len) {
+			int stalled;
+			req->done += res;
+			iov_advance (&req->iov, &req->niov, res);
+			pthread_mutex_lock (&ur.lock);
+			stalled = ur.stalled;
+			if (!stalled)
+				uring_queue (req);
+			pthread_mutex_unlock (&ur.lock);
+			if (!stalled)
+				continue;
+			uring_sync (req);
+		} else
+			req->res = res < 0 ? res : (int) (req->done + res);
+		complete_task (req->task, 1);
+	}
+	__atomic_store_n (ur.cq_head, head, __ATOMIC_RELEASE);
+	
+	pthread_mutex_lock (&ur.lock);
+	ur.inflight -= n;
+	pthread_mutex_unlock (&ur.lock);
+}
+
+/*
+ * gives up the ring: the requests the kernel hasn't taken are done
+ * here, and from now on uring_submit() refuses new ones.  those
+ * already taken still complete through the ring.
+ */
+static void uring_giveup (void) {
+	unsigned head, tail;
+	
+	pthread_mutex_lock (&ur.lock);
+	ur.stalled = 1;
+	ur.queued = 0;
+	head = __atomic_load_n (ur.sq_head, __ATOMIC_ACQUIRE);
+	tail = *ur.sq_tail;
+	pthread_mutex_unlock (&ur.lock);
+	
+	for (; head != tail; head++) {
+		struct io_uring_sqe *sqe = &ur.sqes [ur.sq_array [head & *ur.sq_mask]];
+		uring_req *req = (uring_req *)(unsigned long) sqe->user_data;
+		uring_sync (req);
+		complete_task (req->task, 1);
+	}
+}
+
+static void *uring_service (void *arg) {
+	struct pollfd pfd [2];
+	int fails = 0, backoff = 0;
+	
+	pfd [0].fd = ur.efd;
+	pfd [0].events = POLLIN;
+	pfd [1].fd = ur.fd;
+	pfd [1].events = POLLIN;
+	
+	while (!ur.stop) {
+		unsigned n;
+		int ret;
+		
+		pthread_mutex_lock (&ur.lock);
+		n = ur.queued;
+		pthread_mutex_unlock (&ur.lock);
+		
+		if (n > 0 && backoff)
+			poll (pfd + 1, 1, backoff);			/* only the completions cut it short */
+		else if (n == 0 && poll (pfd, 2, -1) > 0 && (pfd [0].revents & POLLIN)) {
+			__u64 v;
+			if (read (ur.efd, &v, sizeof (v)) < 0)
+				v = 0;
+		}
+		
+		pthread_mutex_lock (&ur.lock);
+		n = ur.queued;
+		ur.queued = 0;
+		ur.inflight += n;
+		pthread_mutex_unlock (&ur.lock);
+		
+		if (n > 0) {
+			ret = syscall (__NR_io_uring_enter, ur.fd, n, 0, 0, NULL, 0);
+			if (ret > 0)
+				fails = backoff = 0;
+			else if (ret == 0 || errno != EINTR) {
+				fails++;
+				backoff = backoff ? backoff * 2 : 1;
+				if (backoff > URING_MAXBACKOFF)
+					backoff = URING_MAXBACKOFF;
+			}
+			if (ret < 0)
+				ret = 0;
+			if ((unsigned) ret < n) {			/* try again on the next round */
+				pthread_mutex_lock (&ur.lock);
+				ur.queued += n - ret;
+				ur.inflight -= n - ret;
+				pthread_mutex_unlock (&ur.lock);
+			}
+			if (fails >= URING_MAXFAILS) {
+				uring_giveup ();
+				fails = backoff = 0;
+			}
+		}
+		uring_reap ();
+	}
+	
+	return NULL;
+}
+
+static void uring_unmap (void) {
+	if (ur.sqes && ur.sqes != MAP_FAILED)
+		munmap (ur.sqes, ur.sqes_size);
+	if (ur.cq_ptr && ur.cq_ptr != MAP_FAILED && ur.cq_ptr != ur.sq_ptr)
+		munmap (ur.cq_ptr, ur.cq_size);
+	if (ur.sq_ptr && ur.sq_ptr != MAP_FAILED)
+		munmap (ur.sq_ptr, ur.sq_size);
+	if (ur.fd >= 0)
+		close (ur.fd);
+	if (ur.efd >= 0)
+		close (ur.efd);
+	ur.sqes = NULL;
+	ur.sq_ptr = ur.cq_ptr = NULL;
+	ur.fd = ur.efd = -1;
+}
+
+static int uring_start (void) {
+	struct io_uring_params p;
+	unsigned char *sq, *cq;
+	
+	memset (&ur, 0, sizeof (ur));
+	memset (&p, 0, sizeof (p));
+	ur.efd = -1;
+	ur.fd = syscall (__NR_io_uring_setup, URING_ENTRIES, &p);
+	if (ur.fd < 0)
+		return 0;
+	
+	ur.sq_size = p.sq_off.array + p.sq_entries * sizeof (unsigned);
+	ur.cq_size = p.cq_off.cqes + p.cq_entries * sizeof (struct io_uring_cqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ur.cq_size > ur.sq_size)
+			ur.sq_size = ur.cq_size;
+		ur.cq_size = ur.sq_size;
+	}
+	ur.sq_ptr = mmap (NULL, ur.sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+			ur.fd, IORING_OFF_SQ_RING);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		ur.cq_ptr = ur.sq_ptr;
+	else
+		ur.cq_ptr = mmap (NULL, ur.cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+				ur.fd, IORING_OFF_CQ_RING);
+	ur.sqes_size = p.sq_entries * sizeof (struct io_uring_sqe);
+	ur.sqes = (struct io_uring_sqe *)mmap (NULL, ur.sqes_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ur.fd, IORING_OFF_SQES);
+	ur.efd = eventfd (0, EFD_CLOEXEC);
+	if (ur.sq_ptr == MAP_FAILED || ur.cq_ptr == MAP_FAILED
+			|| (void *)ur.sqes == MAP_FAILED || ur.efd < 0) {
+		uring_unmap ();
+		return 0;
+	}
+	
+	sq = (unsigned char *)ur.sq_ptr;
+	cq = (unsigned char *)ur.cq_ptr;
+	ur.sq_head = (unsigned *)(sq + p.sq_off.head);
+	ur.sq_tail = (unsigned *)(sq + p.sq_off.tail);
+	ur.sq_mask = (unsigned *)(sq + p.sq_off.ring_mask);
+	ur.sq_array = (unsigned *)(sq + p.sq_off.array);
+	ur.cq_head = (unsigned *)(cq + p.cq_off.head);
+	ur.cq_tail = (unsigned *)(cq + p.cq_off.tail);
+	ur.cq_mask = (unsigned *)(cq + p.cq_off.ring_mask);
+	ur.cqes = (struct io_uring_cqe *)(cq + p.cq_off.cqes);
+	ur.entries = p.sq_entries;
+	
+	pthread_mutex_init (&ur.lock, NULL);
+	if (pthread_create (&ur.pth, NULL, uring_service, NULL) != 0) {
+		uring_unmap ();
+		return 0;
+	}
+	ur.running = 1;
+	return 1;
+}
+
+/* stops the service thread before the library is unloaded */
+static int uring_gc (lua_State *L) {
+	__u64 one = 1;
+	
+	if (!ur.running)
+		return 0;
+	
+	ur.stop = 1;
+	if (write (ur.efd, &one, sizeof (one)) < 0)
+		return 0;
+	pthread_join (ur.pth, NULL);
+	ur.running = 0;
+	uring_unmap ();
+	return 0;
+}
+
+/*
+ * detaches the task and sends the request to the ring.
+ * if it's full, the helper does it, and completes the task.
+ * writes (IORING_OP_WRITEV) take the pieces from req->iov,
+ * len is their total size.  returns 0 if the task can't be
+ * detached (run by the Lua thread): then the ring isn't touched,
+ * and req->task stays NULL; the caller does it as without a ring.
+ */
+static int fd_submit (uring_req *req, int fd, int op, off_t off, unsigned char *buf, size_t len) {
+	void *task = detach_task ();
+	
+	if (!task)
+		return 0;
+	req->task = task;
+	req->fd = fd;
+	req->op = op;
+	req->off = off;
+	req->buf = buf;
+	req->len = len;
+	req->done = 0;
+	req->res = 0;
+	if (uring_submit (req))
+		return 1;
+	
+	uring_sync (req);
+	complete_task (req->task, 1);
+	return 1;
+}
+
+/*
+ * sends a read or write on the file's descriptor to the ring, after
+ * syncing the descriptor with the stdio position (flushing pending
+ * writes, or giving back read-ahead).  only for seekable files when
+ * reading, or read-ahead data would be lost.  returns 0 if the helper
+ * has to do it by itself; if not, the task is detached.
+ */
+static int file_submit (uring_req *req, FILE *f, int op, unsigned char *buf, size_t len) {
+	int fd = fileno (f);
+	
+	if (!ur.running)
+		return 0;
+	if (fflush (f) != 0)
+		return 0;
+	if (op == IORING_OP_READ && lseek (fd, 0, SEEK_CUR) < 0)
+		return 0;
+	
+	return fd_submit (req, fd, op, -1, buf, len);
+}
+
+#endif
+
+/*
+ * after a request was done by the ring, moves the stdio position to the
+ * descriptor's, as the cached offset is stale
+ */
+static void file_resync (uring_req *req, FILE *f) {
+	off_t pos;
+	
+	if (!req->task)
+		return;
+	pos = lseek (fileno (f), 0, SEEK_CUR);
+	if (pos >= 0)
+		fseeko (f, pos, SEEK_SET);
+}
+
 /******************************************
  **  READ
  ******************************************/
@@ -121,9 +557,12 @@ typedef enum read_kind_t {
 	RK_NULL,
 	RK_ATMOST,
 	RK_LINE,
+	RK_LINES,
 	RK_ALL
 } read_kind_t;
 
+#define READ_DEFLINES	64
+
 typedef struct read_udata {
 	FILE *f;
 	size_t size;
@@ -131,6 +570,9 @@ typedef struct read_udata {
 	buffer_t b;
 	int ferror;
 	int feof;
+	int nlines, count;			/* "*L": lines wanted and read */
+	size_t *lens;
+	uring_req req;
 } read_udata;
 
 static int read_prepare (lua_State *L, void **udata) {
@@ -144,6 +586,10 @@ static int read_prepare (lua_State *L, void **udata) {
 	buffer_init (&ud->b);
 	ud->ferror = 0;
 	ud->feof = 0;
+	ud->nlines = 1;
+	ud->count = 0;
+	ud->lens = NULL;
+	ud->req.task = NULL;
 	
 	ud->f = tofile (L, 1);
 	
@@ -165,6 +611,15 @@ static int read_prepare (lua_State *L, void **udata) {
 					case 'l':
 						ud->kind = RK_LINE;
 						break;
+					case 'L':
+						ud->kind = RK_LINES;
+						ud->nlines = luaL_optint (L, 3, READ_DEFLINES);
+						if (ud->nlines < 1)
+							ud->nlines = 1;
+						ud->lens = (size_t *)malloc (ud->nlines * sizeof (size_t));
+						if (!ud->lens)
+							luaL_error (L, "can't allocate read udata");
+						break;
 					case 'a':
 						ud->kind = RK_ALL;
 						break;
@@ -182,30 +637,211 @@ static int read_prepare (lua_State *L, void **udata) {
 	return 0;
 }
 
+/*
+ * reads up to ud->nlines lines, without the '\n' (or "\r\n").
+ * getline() finds the end of line with memchr() on the stdio buffer,
+ * so it works on whole blocks, and the file position is kept right
+ * for the Lua io functions.  a single line is left as the buffer,
+ * several are appended, with their lengths in ud->lens
+ */
+static void read_lines (read_udata *ud) {
+	char *line = NULL;
+	size_t cap = 0;
+	ssize_t len;
+	
+	while (ud->count < ud->nlines && (len = getline (&line, &cap, ud->f)) >= 0) {
+		if (len > 0 && line [len-1] == '\n')
+			len--;
+		if (len > 0 && line [len-1] == '\r')
+			len--;
+		
+		if (ud->kind == RK_LINE) {
+			ud->b.data = (unsigned char *)line;
+			ud->b.end = ud->b.data + len;
+			ud->b.bufsize = cap;
+			line = NULL;
+		} else {
+			buffer_add (&ud->b, line, len);
+			ud->lens [ud->count] = len;
+		}
+		ud->count++;
+	}
+	free (line);
+	
+	ud->ferror = ferror (ud->f) ? errno : 0;
+	ud->feof = feof (ud->f);
+}
+
+/*
+ * readahead for sequential reads of a fixed size.  the state of each
+ * file handle (a few of them, in a small table keyed by the FILE*)
+ * records where the last read ended.  after a few consecutive reads of
+ * the same size, the next chunk is read with pread() by an idle helper
+ * (post_job()) while Lua works on the current one, and the next read
+ * takes that buffer if it starts at the same place.
+ */
+#define RA_SLOTS		64
+#define RA_STREAK		2				/* sequential reads before prefetching */
+#define RA_MAXSIZE		(4 * 1024 * 1024)
+
+typedef struct ra_state {
+	FILE *f;
+	int fd;
+	dev_t dev;
+	ino_t ino;
+	off_t next;						/* where the last read should end */
+	size_t size;					/* of the last read */
+	int streak;
+	int busy;						/* a prefetch is running */
+	int dead;						/* dropped while busy, the prefetch frees it */
+	off_t off;						/* of the prefetched data */
+	size_t want;
+	buffer_t b;
+} ra_state;
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t done;
+	ra_state *slots [RA_SLOTS];
+} ra = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER};
+
+/* with the lock held */
+static void ra_drop (ra_state *s) {
+	if (s->busy)
+		s->dead = 1;
+	else {
+		buffer_free (&s->b);
+		free (s);
+	}
+}
+
+static int ra_prefetch (void *arg) {
+	ra_state *s = (ra_state *)arg;
+	size_t got = 0;
+	
+	while (got < s->want) {
+		ssize_t n = pread (s->fd, s->b.data + got, s->want - got, s->off + got);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		got += n;
+	}
+#ifdef POSIX_FADV_WILLNEED
+	if (got == s->want)
+		posix_fadvise (s->fd, s->off + got, s->want, POSIX_FADV_WILLNEED);
+#endif
+	
+	pthread_mutex_lock (&ra.lock);
+	s->b.end = s->b.data + got;
+	s->busy = 0;
+	if (s->dead)
+		ra_drop (s);
+	pthread_cond_broadcast (&ra.done);
+	pthread_mutex_unlock (&ra.lock);
+	return 0;
+}
+
+/*
+ * called by read_work() for a read of ud->size bytes.  if the data was
+ * prefetched, it's given to ud and the file position moved past it.
+ * returns 1 in that case.  may start the next prefetch.
+ */
+static int ra_read (read_udata *ud) {
+	FILE *f = ud->f;
+	int fd = fileno (f);
+	size_t slot = ((size_t) f / sizeof (void *)) % RA_SLOTS;
+	ra_state *s;
+	struct stat st;
+	off_t pos;
+	int served = 0;
+	
+	if (ud->size > RA_MAXSIZE || fstat (fd, &st) < 0 || !S_ISREG (st.st_mode)
+			|| (pos = ftello (f)) < 0)
+		return 0;
+	
+	pthread_mutex_lock (&ra.lock);
+	s = ra.slots [slot];
+	if (!s || s->f != f || s->fd != fd || s->dev != st.st_dev || s->ino != st.st_ino) {
+		if (s)
+			ra_drop (s);
+		s = ra.slots [slot] = (ra_state *)malloc (sizeof (ra_state));
+		if (!s) {
+			pthread_mutex_unlock (&ra.lock);
+			return 0;
+		}
+		s->f = f;
+		s->fd = fd;
+		s->dev = st.st_dev;
+		s->ino = st.st_ino;
+		s->next = -1;
+		s->size = 0;
+		s->streak = 0;
+		s->busy = s->dead = 0;
+		s->off = -1;
+		buffer_init (&s->b);
+	}
+	while (s->busy)
+		pthread_cond_wait (&ra.done, &ra.lock);
+	
+	if (s->off == pos && s->want == ud->size && s->b.data) {
+		buffer_free (&ud->b);
+		ud->b = s->b;
+		buffer_init (&s->b);
+		ud->feof = buffer_len (&ud->b) < ud->size;
+		served = 1;
+	}
+	s->off = -1;
+	
+	s->streak = (pos == s->next && ud->size == s->size) ? s->streak + 1 : 0;
+	s->size = ud->size;
+	s->next = pos + (served ? buffer_len (&ud->b) : ud->size);
+	
+	if (s->streak >= RA_STREAK && !(served && ud->feof)) {
+		buffer_resize (&s->b, ud->size);
+		if (s->b.data) {
+			s->off = s->next;
+			s->want = ud->size;
+			s->busy = 1;
+			if (!post_job (ra_prefetch, s)) {
+				s->busy = 0;
+				s->off = -1;
+			}
+		}
+	}
+	pthread_mutex_unlock (&ra.lock);
+	
+	if (served)
+		fseeko (f, pos + buffer_len (&ud->b), SEEK_SET);
+	return served;
+}
+
 static int read_work (void *udata) {
 	read_udata *ud = (read_udata *)udata;
-	int c;
 	switch (ud->kind) {
 		
 		case RK_ATMOST:
+			if (ra_read (ud))
+				break;
+#ifdef NB_FILE_URING
+			if (file_submit (&ud->req, ud->f, IORING_OP_READ, ud->b.end, ud->size))
+				break;
+#endif
 			buffer_fread (&ud->b, ud->f, ud->size);
-			ud->ferror = ferror (ud->f);
+			ud->ferror = ferror (ud->f) ? errno : 0;
 			ud->feof = feof (ud->f);
 			break;
 			
 		case RK_LINE:
-			while ((c=fgetc (ud->f)) != '\n' && c != '\r' && c != EOF)
-				buffer_addchar (&ud->b, c);
-			
-			ud->ferror = ferror (ud->f);
-			ud->feof = feof (ud->f);
+		case RK_LINES:
+			read_lines (ud);
 			break;
 			
 		case RK_ALL:
 			while (!feof (ud->f))
 				buffer_fread (&ud->b, ud->f, 8192);
 			ud->feof = feof (ud->f);
-			ud->ferror = ferror (ud->f);
+			ud->ferror = ferror (ud->f) ? errno : 0;
 			break;
 		default:
 			break;
@@ -218,11 +854,39 @@ static int read_update (lua_State *L, void *udata) {
 	read_udata *ud = (read_udata *)udata;
 	int ret = 1;
 	
+	if (ud->req.task) {
+		file_resync (&ud->req, ud->f);
+		if (ud->req.res < 0)
+			ud->ferror = -ud->req.res;
+		else {
+			ud->b.end += ud->req.res;
+			ud->feof = ((size_t) ud->req.res < ud->size);
+		}
+	}
+	
 	if (ud->ferror != 0) {
 		lua_pushnil (L);
 		lua_pushstring (L, strerror (ud->ferror));
 		ret = 2;
 	
+	} else if (ud->kind == RK_LINES) {
+		if (ud->count == 0 && ud->feof)
+			lua_pushnil (L);
+		else {
+			const char *p = (const char *)ud->b.data;
+			int i;
+			
+			lua_createtable (L, ud->count, 0);
+			for (i = 0; i < ud->count; i++) {
+				lua_pushlstring (L, p, ud->lens [i]);
+				lua_rawseti (L, -2, i+1);
+				p += ud->lens [i];
+			}
+		}
+	
+	} else if (ud->kind == RK_LINE && ud->count > 0) {
+		lua_pushlstring (L, (char *)ud->b.data, buffer_len (&ud->b));
+	
 	} else if (buffer_len (&ud->b) > 0) {
 		lua_pushlstring (L, (char *)ud->b.data, buffer_len (&ud->b));
 	
@@ -231,6 +895,7 @@ static int read_update (lua_State *L, void *udata) {
 	}
 	
 	buffer_free (&ud->b);
+	free (ud->lens);
 	free (ud);
 	return ret;
 }
@@ -246,38 +911,102 @@ static const task_ops read_ops = {
  **  WRITE
  ******************************************/
 
+/*
+ * the data to write can be a string, an array of strings, or several
+ * string arguments (from first to last on the stack).  the strings
+ * aren't copied: they're kept referenced until the update, and the
+ * helper writes them straight from Lua's memory.
+ */
+static int pieces_check (lua_State *L, int first, int last) {
+	int i, n;
+	
+	if (last < first)
+		luaL_argerror (L, first, "string expected");
+	if (first != last || !lua_istable (L, first)) {
+		for (i = first; i <= last; i++)
+			luaL_checktype (L, i, LUA_TSTRING);
+		return last - first + 1;
+	}
+	
+	n = lua_objlen (L, first);
+	for (i = 1; i <= n; i++) {
+		lua_rawgeti (L, first, i);
+		if (lua_type (L, -1) != LUA_TSTRING)
+			luaL_error (L, "bad piece #%d (string expected, got %s)", i, lua_typename (L, lua_type (L, -1)));
+		lua_pop (L, 1);
+	}
+	return n;
+}
+
+/* fills the iovecs and returns a reference that keeps the pieces alive */
+static int pieces_pin (lua_State *L, int first, int n, struct iovec *iov, size_t *len) {
+	int istable = lua_istable (L, first);
+	int i;
+	
+	*len = 0;
+	lua_createtable (L, n, 0);
+	for (i = 0; i < n; i++) {
+		size_t l;
+		if (istable)
+			lua_rawgeti (L, first, i+1);
+		else
+			lua_pushvalue (L, first+i);
+		iov [i].iov_base = (void *)lua_tolstring (L, -1, &l);
+		iov [i].iov_len = l;
+		*len += l;
+		lua_rawseti (L, -2, i+1);
+	}
+	return luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
 typedef struct write_udata {
 	FILE *f;
-	buffer_t b;
+	int ref;
 	int ferror;
+	uring_req req;
 } write_udata;
 
+/*
+ * nb_file.write (file, data)
+ * nb_file.write (file, {data1, data2, ...})
+ * nb_file.write (file, data1, data2, ...)
+ */
 static int write_prepare (lua_State *L, void **udata) {
 	write_udata *ud = NULL;
 	FILE *f = tofile (L, 1);
-
-	luaL_checktype (L, 2, LUA_TSTRING);
+	int last = lua_gettop (L) - 1;			/* the task is on top */
+	int n = pieces_check (L, 2, last);
 	
-	ud = (write_udata *)malloc (sizeof (write_udata));
+	ud = (write_udata *)malloc (sizeof (write_udata) + n * sizeof (struct iovec));
 	if (!ud)
 		luaL_error (L, "can't allocate write udata");
 	*udata = ud;
-	buffer_init (&ud->b);
 	
 	ud->f = f;
-	buffer_add (&ud->b, lua_tostring (L, 2), lua_strlen (L, 2));
+	ud->req.iov = (struct iovec *)(ud + 1);
+	ud->req.niov = n;
+	ud->ref = pieces_pin (L, 2, n, ud->req.iov, &ud->req.len);
 	ud->ferror = 0;
+	ud->req.task = NULL;
 	
 	return 0;
 }
 
 static int write_work (void *udata) {
 	write_udata *ud = (write_udata *)udata;
-	unsigned char *p = buffer_data (&ud->b);
-	size_t len = buffer_len (&ud->b);
+	int i;
 	
-	if (fwrite (p, 1, len, ud->f) != len)
-		ud->ferror = ferror (ud->f);
+#ifdef NB_FILE_URING
+	if (file_submit (&ud->req, ud->f, IORING_OP_WRITEV, NULL, ud->req.len))
+		return 0;
+#endif
+	for (i = 0; i < ud->req.niov; i++) {
+		struct iovec *v = &ud->req.iov [i];
+		if (fwrite (v->iov_base, 1, v->iov_len, ud->f) != v->iov_len) {
+			ud->ferror = ferror (ud->f) ? errno : EIO;
+			break;
+		}
+	}
 	
 	return 0;
 }
@@ -286,6 +1015,12 @@ static int write_update (lua_State *L, void *udata) {
 	write_udata *ud = (write_udata *)udata;
 	int ret;
 	
+	if (ud->req.task) {
+		file_resync (&ud->req, ud->f);
+		if (ud->req.res < 0)
+			ud->ferror = -ud->req.res;
+	}
+	
 	if (ud->ferror) {
 		lua_pushnil(L);
 		lua_pushfstring(L, "%s", strerror(ud->ferror));
@@ -295,7 +1030,7 @@ static int write_update (lua_State *L, void *udata) {
 		lua_pushboolean(L, 1);
 		ret = 1;
 	}
-	buffer_free (&ud->b);
+	luaL_unref (L, LUA_REGISTRYINDEX, ud->ref);
 	free (ud);
 	
 	return ret;
@@ -307,20 +1042,2141 @@ static const task_ops write_ops = {
 	write_update
 };
 
-/***************************************
- **  Initialization
- ***************************************/
+/******************************************
+ **  MAP
+ ******************************************/
 
-static const task_reg nb_file_reg [] = {
-	{"read", &read_ops},
-	{"write", &write_ops},
-	{NULL}
-};
+static const char MapType[] = "__NBFileMapType__";
 
-int luaopen_nb_file (lua_State *L);
-int luaopen_nb_file (lua_State *L) {
-	helper_init (L);
+typedef struct map_t {
+	unsigned char *addr;
+	size_t len;
+} map_t;
+
+static map_t *check_map (lua_State *L, int index) {
+	map_t *m = (map_t *)luaL_checkudata (L, index, MapType);
+	luaL_argcheck (L, m, index, "file map expected");
+	return m;
+}
+
+static map_t *check_openmap (lua_State *L, int index) {
+	map_t *m = check_map (L, index);
+	if (m->len && !m->addr)
+		luaL_error (L, "attempt to use a closed map");
+	return m;
+}
+
+/* 0-based offset at index, checked against the map length */
+static size_t check_offset (lua_State *L, int index, map_t *m) {
+	lua_Number off = luaL_optnumber (L, index, 0);
+	luaL_argcheck (L, off >= 0 && off <= m->len, index, "offset out of range");
+	return (size_t) off;
+}
+
+/*
+ * map:sub (offset [, len])
+ * a string with len bytes (default, up to the end) from the 0-based offset
+ */
+static int map_sub (lua_State *L) {
+	map_t *m = check_openmap (L, 1);
+	size_t off = check_offset (L, 2, m);
+	lua_Number len = luaL_optnumber (L, 3, m->len - off);
+	
+	if (len < 0)
+		len = 0;
+	if (len > m->len - off)
+		len = m->len - off;
+	lua_pushlstring (L, (const char *)m->addr + off, (size_t) len);
+	return 1;
+}
+
+/*
+ * map:len ()
+ */
+static int map_len (lua_State *L) {
+	map_t *m = check_map (L, 1);
+	lua_pushnumber (L, m->len);
+	return 1;
+}
+
+/*
+ * map:find (str [, offset])
+ * 0-based offset of the first occurrence of str, at or after offset
+ */
+static int map_find (lua_State *L) {
+	map_t *m = check_openmap (L, 1);
+	size_t slen;
+	const char *str = luaL_checklstring (L, 2, &slen);
+	size_t off = check_offset (L, 3, m);
+	const unsigned char *p;
+	
+	p = (const unsigned char *)memmem (m->addr + off, m->len - off, str, slen);
+	if (!p)
+		return 0;
+	lua_pushnumber (L, p - m->addr);
+	return 1;
+}
+
+/*
+ * map:close ()
+ * unmaps the file, strings taken with sub() are still valid
+ */
+static int map_close (lua_State *L) {
+	map_t *m = check_map (L, 1);
+	if (m->addr) {
+		munmap (m->addr, m->len);
+		m->addr = NULL;
+	}
+	return 0;
+}
+
+static int map_tostring (lua_State *L) {
+	map_t *m = check_map (L, 1);
+	if (m->len && !m->addr)
+		lua_pushliteral (L, "file map (closed)");
+	else
+		lua_pushfstring (L, "file map (%p)", m);
+	return 1;
+}
+
+typedef struct map_udata {
+	char *path;
+	int populate;
+	int advice;
+	map_t m;
+	int err;
+} map_udata;
+
+/*
+ * nb_file.map (path [, opts])
+ * opts is a table with:
+ *   advice: "normal", "sequential", "random" or "willneed"
+ *   populate: true to read all the pages in the helper thread
+ */
+static int map_prepare (lua_State *L, void **udata) {
+	size_t len;
+	const char *path = luaL_checklstring (L, 1, &len);
+	int populate = 0, advice = MADV_NORMAL;
+	map_udata *ud;
+	
+	if (lua_istable (L, 2)) {
+		lua_getfield (L, 2, "populate");
+		populate = lua_toboolean (L, -1);
+		lua_pop (L, 1);
+		
+		lua_getfield (L, 2, "advice");
+		if (lua_isstring (L, -1)) {
+			const char *adv = lua_tostring (L, -1);
+			if (!strcmp (adv, "sequential"))
+				advice = MADV_SEQUENTIAL;
+			else if (!strcmp (adv, "random"))
+				advice = MADV_RANDOM;
+			else if (!strcmp (adv, "willneed"))
+				advice = MADV_WILLNEED;
+			else if (strcmp (adv, "normal"))
+				luaL_error (L, "unknown advice '%s'", adv);
+		}
+		lua_pop (L, 1);
+	}
+	
+	ud = (map_udata *)malloc (sizeof (map_udata) + len + 1);
+	if (!ud)
+		luaL_error (L, "can't allocate map udata");
+	*udata = ud;
+	
+	ud->path = (char *)(ud + 1);
+	memcpy (ud->path, path, len + 1);
+	ud->populate = populate;
+	ud->advice = advice;
+	ud->m.addr = NULL;
+	ud->m.len = 0;
+	ud->err = 0;
+	
+	return 0;
+}
+
+static int map_work (void *udata) {
+	map_udata *ud = (map_udata *)udata;
+	struct stat st;
+	int flags = MAP_SHARED;
+	void *addr;
+	int fd = open (ud->path, O_RDONLY);
+	
+	if (fd < 0) {
+		ud->err = errno;
+		return 0;
+	}
+	if (fstat (fd, &st) != 0) {
+		ud->err = errno;
+		close (fd);
+		return 0;
+	}
+	
+	ud->m.len = st.st_size;
+	if (ud->m.len > 0) {
+#ifdef MAP_POPULATE
+		if (ud->populate)
+			flags |= MAP_POPULATE;
+#endif
+		addr = mmap (NULL, ud->m.len, PROT_READ, flags, fd, 0);
+		if (addr == MAP_FAILED)
+			ud->err = errno;
+		else {
+			ud->m.addr = (unsigned char *)addr;
+			if (ud->advice != MADV_NORMAL)
+				madvise (addr, ud->m.len, ud->advice);
+		}
+	}
+	close (fd);
+	
+	return 0;
+}
+
+static int map_update (lua_State *L, void *udata) {
+	map_udata *ud = (map_udata *)udata;
+	map_t *m;
+	
+	if (ud->err) {
+		lua_pushnil (L);
+		lua_pushfstring (L, "%s: %s", ud->path, strerror (ud->err));
+		free (ud);
+		return 2;
+	}
+	
+	m = (map_t *)lua_newuserdata (L, sizeof (map_t));
+	*m = ud->m;
+	free (ud);
+	luaL_getmetatable (L, MapType);
+	lua_setmetatable (L, -2);
+	return 1;
+}
+
+static const task_ops map_ops = {
+	map_prepare,
+	map_work,
+	map_update
+};
+
+/******************************************
+ **  SCAN
+ ******************************************/
+
+/* built-in kernels */
+
+/* lines, as counted by 'wc -l', plus an unterminated last one */
+static void lines_scan (const scan_chunk *c, void *res) {
+	const unsigned char *p = c->p, *end = c->p + c->len;
+	size_t n = 0;
+	
+	while (p < end && (p = memchr (p, '\n', end - p)) != NULL) {
+		n++;
+		p++;
+	}
+	if (c->tail == 0 && c->len > 0 && end [-1] != '\n')
+		n++;
+	*(size_t *)res = n;
+}
+
+static void count_merge (void *acc, const void *res) {
+	*(size_t *)acc += *(const size_t *)res;
+}
+
+static int count_push (lua_State *L, const void *acc) {
+	lua_pushnumber (L, *(const size_t *)acc);
+	return 1;
+}
+
+static const scan_kernel lines_kernel = {
+	sizeof (size_t),
+	lines_scan,
+	count_merge,
+	count_push
+};
+
+/*
+ * matches of the argument starting in the chunk.  the search goes
+ * on into the next chunk just enough to find those that cross
+ */
+static size_t match_window (const scan_chunk *c) {
+	size_t over = c->arglen - 1;
+	return c->len + (over < c->tail ? over : c->tail);
+}
+
+static void count_scan (const scan_chunk *c, void *res) {
+	const unsigned char *p = c->p, *end = c->p + match_window (c);
+	size_t n = 0;
+	
+	while ((p = memmem (p, end - p, c->arg, c->arglen)) != NULL) {
+		n++;
+		p += c->arglen;
+	}
+	*(size_t *)res = n;
+}
+
+static const scan_kernel count_kernel = {
+	sizeof (size_t),
+	count_scan,
+	count_merge,
+	count_push
+};
+
+typedef struct find_res {
+	int found;
+	off_t pos;
+} find_res;
+
+static void find_scan (const scan_chunk *c, void *res) {
+	find_res *r = (find_res *)res;
+	const unsigned char *p = memmem (c->p, match_window (c), c->arg, c->arglen);
+	
+	if (p) {
+		r->found = 1;
+		r->pos = c->off + (p - c->p);
+	}
+}
+
+static void find_merge (void *acc, const void *res) {
+	find_res *a = (find_res *)acc;
+	if (!a->found)
+		*a = *(const find_res *)res;
+}
+
+static int find_push (lua_State *L, const void *acc) {
+	const find_res *a = (const find_res *)acc;
+	if (a->found)
+		lua_pushnumber (L, a->pos);
+	else
+		lua_pushnil (L);
+	return 1;
+}
+
+static const scan_kernel find_kernel = {
+	sizeof (find_res),
+	find_scan,
+	find_merge,
+	find_push
+};
+
+/*
+ * nb_file.scan (path, chunksize [, opts])
+ * opts.kernel: "lines" (default), "count", "find" or a C kernel (nb_file.h)
+ * opts.arg: the string to "count" or "find", or whatever a C kernel wants
+ */
+#define SCAN_MINCHUNK	4096
+
+typedef struct scan_job {
+	const scan_kernel *k;
+	scan_chunk c;
+	void *res;
+} scan_job;
+
+typedef struct scan_udata {
+	char *path;
+	size_t chunk;
+	const scan_kernel *k;
+	int ref;						/* keeps the arg */
+	const char *arg;
+	size_t arglen;
+	void *addr;
+	size_t size;
+	scan_job *jobs;
+	size_t njobs;
+	unsigned char *res;
+	int err;
+} scan_udata;
+
+static int scan_prepare (lua_State *L, void **udata) {
+	size_t len, arglen = 0;
+	const char *path = luaL_checklstring (L, 1, &len);
+	lua_Number chunk = luaL_checknumber (L, 2);
+	const scan_kernel *k = &lines_kernel;
+	const char *arg = NULL;
+	int ref = LUA_NOREF;
+	scan_udata *ud;
+	
+	if (lua_istable (L, 3)) {
+		lua_getfield (L, 3, "kernel");
+		if (lua_islightuserdata (L, -1))
+			k = (const scan_kernel *)lua_touserdata (L, -1);
+		else if (!lua_isnil (L, -1)) {
+			static const char *const names [] = {"lines", "count", "find", NULL};
+			static const scan_kernel *const kernels [] = {&lines_kernel, &count_kernel, &find_kernel};
+			k = kernels [luaL_checkoption (L, -1, NULL, names)];
+		}
+		lua_pop (L, 1);
+		
+		lua_getfield (L, 3, "arg");
+		if (lua_isstring (L, -1)) {
+			arg = lua_tolstring (L, -1, &arglen);
+			ref = luaL_ref (L, LUA_REGISTRYINDEX);
+		} else
+			lua_pop (L, 1);
+	}
+	if ((k == &count_kernel || k == &find_kernel) && arglen == 0)
+		luaL_error (L, "the kernel needs a non-empty 'arg'");
+	
+	ud = (scan_udata *)malloc (sizeof (scan_udata) + len + 1);
+	if (!ud)
+		luaL_error (L, "can't allocate scan udata");
+	*udata = ud;
+	ud->path = (char *)(ud + 1);
+	memcpy (ud->path, path, len + 1);
+	ud->chunk = chunk > SCAN_MINCHUNK ? (size_t) chunk : SCAN_MINCHUNK;
+	ud->k = k;
+	ud->ref = ref;
+	ud->arg = arg;
+	ud->arglen = arglen;
+	ud->addr = NULL;
+	ud->size = 0;
+	ud->jobs = NULL;
+	ud->njobs = 0;
+	ud->res = NULL;
+	ud->err = 0;
+	return 0;
+}
+
+static int scan_chunk_work (void *arg) {
+	scan_job *job = (scan_job *)arg;
+	job->k->scan (&job->c, job->res);
+	return 0;
+}
+
+/* cuts the map in chunks that end after a newline, and spawns a subtask for each */
+static int scan_work (void *udata) {
+	scan_udata *ud = (scan_udata *)udata;
+	const unsigned char *p;
+	struct stat st;
+	size_t start, i, maxjobs;
+	int fd = open (ud->path, O_RDONLY | O_CLOEXEC);
+	
+	if (fd < 0 || fstat (fd, &st) < 0) {
+		ud->err = errno;
+		if (fd >= 0)
+			close (fd);
+		return 0;
+	}
+	ud->size = st.st_size;
+	if (ud->size > 0) {
+		ud->addr = mmap (NULL, ud->size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (ud->addr == MAP_FAILED) {
+			ud->err = errno;
+			ud->addr = NULL;
+		}
+	}
+	close (fd);
+	if (ud->err || ud->size == 0)
+		return 0;
+	
+	maxjobs = (ud->size + ud->chunk - 1) / ud->chunk;
+	ud->jobs = (scan_job *)malloc (maxjobs * sizeof (scan_job));
+	ud->res = (unsigned char *)calloc (maxjobs, ud->k->size);
+	if (!ud->jobs || (!ud->res && ud->k->size > 0)) {
+		ud->err = ENOMEM;
+		return 0;
+	}
+	
+	p = (const unsigned char *)ud->addr;
+	for (start = 0; start < ud->size; ud->njobs++) {
+		scan_job *job = &ud->jobs [ud->njobs];
+		size_t end = start + ud->chunk;
+		if (end >= ud->size)
+			end = ud->size;
+		else {
+			const unsigned char *nl = memchr (p + end - 1, '\n', ud->size - end + 1);
+			end = nl ? (size_t) (nl - p) + 1 : ud->size;
+		}
+		job->k = ud->k;
+		job->c.p = p + start;
+		job->c.len = end - start;
+		job->c.tail = ud->size - end;
+		job->c.off = start;
+		job->c.arg = ud->arg;
+		job->c.arglen = ud->arglen;
+		job->res = ud->res + ud->njobs * ud->k->size;
+		start = end;
+	}
+	
+	if (ud->njobs == 1)
+		scan_chunk_work (&ud->jobs [0]);
+	else
+		for (i = 0; i < ud->njobs; i++)
+			spawn_subtask (scan_chunk_work, &ud->jobs [i]);
+	return 0;
+}
+
+static int scan_update (lua_State *L, void *udata) {
+	scan_udata *ud = (scan_udata *)udata;
+	void *acc = NULL;
+	size_t i;
+	int ret;
+	
+	if (!ud->err && !(acc = calloc (1, ud->k->size > 0 ? ud->k->size : 1)))
+		ud->err = ENOMEM;
+	
+	if (ud->err) {
+		lua_pushnil (L);
+		lua_pushfstring (L, "%s: %s", ud->path, strerror (ud->err));
+		ret = 2;
+	} else {
+		for (i = 0; i < ud->njobs; i++)
+			ud->k->merge (acc, ud->jobs [i].res);
+		ret = ud->k->push (L, acc);
+	}
+	
+	if (ud->addr)
+		munmap (ud->addr, ud->size);
+	luaL_unref (L, LUA_REGISTRYINDEX, ud->ref);
+	free (acc);
+	free (ud->jobs);
+	free (ud->res);
+	free (ud);
+	return ret;
+}
+
+static const task_ops scan_ops = {
+	scan_prepare,
+	scan_work,
+	scan_update
+};
+
+/******************************************
+ **  FILE DESCRIPTORS
+ ******************************************/
+
+static const char FdType[] = "__NBFileFdType__";
+
+typedef struct fd_t {
+	int fd;
+	pthread_mutex_t lock;			/* group commit, see append_work() */
+	struct append_udata *waiting;
+	int syncing;
+	int busy;						/* tasks using it, see fd_hold() */
+	int closing;					/* close() it when they're done, or -1 */
+} fd_t;
+
+static fd_t *check_fd (lua_State *L, int index) {
+	fd_t *f = (fd_t *)luaL_checkudata (L, index, FdType);
+	luaL_argcheck (L, f, index, "file descriptor expected");
+	return f;
+}
+
+static int check_openfd (lua_State *L, int index) {
+	fd_t *f = check_fd (L, index);
+	if (f->fd < 0)
+		luaL_error (L, "attempt to use a closed file");
+	return f->fd;
+}
+
+/*
+ * a task using the descriptor holds it from prepare() to update(): the
+ * ref keeps it from being collected, and fd:close() leaves the close()
+ * to the last one to finish.  call it when nothing else can fail.
+ */
+static int fd_hold (lua_State *L, int index) {
+	fd_t *f = check_fd (L, index);
+	
+	pthread_mutex_lock (&f->lock);
+	f->busy++;
+	pthread_mutex_unlock (&f->lock);
+	lua_pushvalue (L, index);
+	return luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
+static void fd_release (lua_State *L, int ref) {
+	fd_t *f;
+	int fd = -1;
+	
+	if (ref == LUA_NOREF)
+		return;
+	lua_rawgeti (L, LUA_REGISTRYINDEX, ref);
+	f = (fd_t *)lua_touserdata (L, -1);
+	lua_pop (L, 1);
+	pthread_mutex_lock (&f->lock);
+	if (--f->busy == 0) {
+		fd = f->closing;
+		f->closing = -1;
+	}
+	pthread_mutex_unlock (&f->lock);
+	if (fd >= 0)
+		close (fd);
+	luaL_unref (L, LUA_REGISTRYINDEX, ref);
+}
+
+/*
+ * fd:close ()
+ * the descriptor can't be used anymore, but it's really closed only
+ * when the tasks still using it are done
+ */
+static int fd_close (lua_State *L) {
+	fd_t *f = check_fd (L, 1);
+	int fd;
+	
+	pthread_mutex_lock (&f->lock);
+	fd = f->fd;
+	f->fd = -1;
+	if (f->busy > 0) {
+		f->closing = fd;
+		fd = -1;
+	}
+	pthread_mutex_unlock (&f->lock);
+	if (fd >= 0)
+		close (fd);
+	return 0;
+}
+
+static int fd_gc (lua_State *L) {
+	fd_t *f = check_fd (L, 1);
+	fd_close (L);
+	pthread_mutex_destroy (&f->lock);
+	return 0;
+}
+
+static int fd_tostring (lua_State *L) {
+	fd_t *f = check_fd (L, 1);
+	if (f->fd < 0)
+		lua_pushliteral (L, "file descriptor (closed)");
+	else
+		lua_pushfstring (L, "file descriptor (%d)", f->fd);
+	return 1;
+}
+
+/*
+ * nb_file.open (path [, mode])
+ * mode as in io.open(): "r", "w", "a", "r+", "w+" or "a+" (default "r")
+ */
+typedef struct open_udata {
+	char *path;
+	int flags;
+	int fd;
+	int err;
+} open_udata;
+
+static int open_prepare (lua_State *L, void **udata) {
+	size_t len;
+	const char *path = luaL_checklstring (L, 1, &len);
+	const char *mode = lua_isstring (L, 2) ? lua_tostring (L, 2) : "r";	/* the task is on top */
+	int flags;
+	open_udata *ud;
+	
+	switch (mode [0]) {
+		case 'r':
+			flags = 0;
+			break;
+		case 'w':
+			flags = O_CREAT | O_TRUNC;
+			break;
+		case 'a':
+			flags = O_CREAT | O_APPEND;
+			break;
+		default:
+			return luaL_argerror (L, 2, "invalid mode");
+	}
+	if (strchr (mode, '+'))
+		flags |= O_RDWR;
+	else
+		flags |= mode [0] == 'r' ? O_RDONLY : O_WRONLY;
+	
+	ud = (open_udata *)malloc (sizeof (open_udata) + len + 1);
+	if (!ud)
+		luaL_error (L, "can't allocate open udata");
+	*udata = ud;
+	ud->path = (char *)(ud + 1);
+	memcpy (ud->path, path, len + 1);
+	ud->flags = flags | O_CLOEXEC;
+	ud->fd = -1;
+	ud->err = 0;
+	return 0;
+}
+
+static int open_work (void *udata) {
+	open_udata *ud = (open_udata *)udata;
+	
+	ud->fd = open (ud->path, ud->flags, 0666);
+	if (ud->fd < 0)
+		ud->err = errno;
+	return 0;
+}
+
+static int open_update (lua_State *L, void *udata) {
+	open_udata *ud = (open_udata *)udata;
+	fd_t *f;
+	
+	if (ud->fd < 0) {
+		lua_pushnil (L);
+		lua_pushfstring (L, "%s: %s", ud->path, strerror (ud->err));
+		free (ud);
+		return 2;
+	}
+	
+	f = (fd_t *)lua_newuserdata (L, sizeof (fd_t));
+	f->fd = ud->fd;
+	pthread_mutex_init (&f->lock, NULL);
+	f->waiting = NULL;
+	f->syncing = 0;
+	f->busy = 0;
+	f->closing = -1;
+	free (ud);
+	luaL_getmetatable (L, FdType);
+	lua_setmetatable (L, -2);
+	return 1;
+}
+
+static const task_ops open_ops = {
+	open_prepare,
+	open_work,
+	open_update
+};
+
+/*
+ * nb_file.pread (fd, offset, len)
+ * fd:pread (offset, len)
+ * reads up to len bytes at offset, without moving the file position,
+ * so several can be done at the same time on the same file
+ */
+typedef struct pio_udata {
+	int fd;
+	int fdref;						/* see fd_hold() */
+	off_t off;
+	buffer_t b;						/* pread */
+	int ref;						/* pwrite: the pinned pieces */
+	int err;
+	uring_req req;
+} pio_udata;
+
+static pio_udata *pio_new (lua_State *L, void **udata, int niov) {
+	int fd = check_openfd (L, 1);
+	lua_Number off = luaL_checknumber (L, 2);
+	pio_udata *ud;
+	
+	luaL_argcheck (L, off >= 0, 2, "negative offset");
+	ud = (pio_udata *)malloc (sizeof (pio_udata) + niov * sizeof (struct iovec));
+	if (!ud)
+		luaL_error (L, "can't allocate pio udata");
+	*udata = ud;
+	ud->fd = fd;
+	ud->fdref = LUA_NOREF;
+	ud->off = (off_t) off;
+	buffer_init (&ud->b);
+	ud->ref = LUA_NOREF;
+	ud->err = 0;
+	ud->req.task = NULL;
+	ud->req.iov = (struct iovec *)(ud + 1);
+	ud->req.niov = niov;
+	return ud;
+}
+
+static int pread_prepare (lua_State *L, void **udata) {
+	lua_Number len = luaL_checknumber (L, 3);
+	pio_udata *ud;
+	
+	luaL_argcheck (L, len >= 0, 3, "negative length");
+	ud = pio_new (L, udata, 0);
+	buffer_resize (&ud->b, (size_t) len);
+	if (len > 0 && !ud->b.data)
+		luaL_error (L, "can't allocate read buffer");
+	ud->fdref = fd_hold (L, 1);
+	return 0;
+}
+
+static int pread_work (void *udata) {
+	pio_udata *ud = (pio_udata *)udata;
+	size_t len = ud->b.bufsize;
+	
+#ifdef NB_FILE_URING
+	if (ur.running && len > 0 && fd_submit (&ud->req, ud->fd, IORING_OP_READ, ud->off, ud->b.data, len))
+		return 0;
+#endif
+	while (buffer_len (&ud->b) < len) {
+		ssize_t n = pread (ud->fd, ud->b.end, len - buffer_len (&ud->b),
+				ud->off + buffer_len (&ud->b));
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			ud->err = errno;
+		if (n <= 0)
+			break;
+		ud->b.end += n;
+	}
+	return 0;
+}
+
+static int pread_update (lua_State *L, void *udata) {
+	pio_udata *ud = (pio_udata *)udata;
+	int ret = 1;
+	
+	if (ud->req.task) {
+		if (ud->req.res < 0)
+			ud->err = -ud->req.res;
+		else
+			ud->b.end += ud->req.res;
+	}
+	
+	if (ud->err) {
+		lua_pushnil (L);
+		lua_pushstring (L, strerror (ud->err));
+		ret = 2;
+	} else if (buffer_len (&ud->b) > 0 || ud->b.bufsize == 0)
+		lua_pushlstring (L, (char *)ud->b.data, buffer_len (&ud->b));
+	else
+		lua_pushnil (L);
+	
+	buffer_free (&ud->b);
+	fd_release (L, ud->fdref);
+	free (ud);
+	return ret;
+}
+
+static const task_ops pread_ops = {
+	pread_prepare,
+	pread_work,
+	pread_update
+};
+
+/*
+ * nb_file.pwrite (fd, offset, data)
+ * fd:pwrite (offset, data)
+ * writes data at offset, returns the number of bytes written.
+ * data can be several pieces, as in nb_file.write()
+ */
+static int pwrite_prepare (lua_State *L, void **udata) {
+	int n = pieces_check (L, 3, lua_gettop (L) - 1);
+	pio_udata *ud = pio_new (L, udata, n);
+	
+	ud->ref = pieces_pin (L, 3, n, ud->req.iov, &ud->req.len);
+	ud->fdref = fd_hold (L, 1);
+	return 0;
+}
+
+static int pwrite_work (void *udata) {
+	pio_udata *ud = (pio_udata *)udata;
+	
+#ifdef NB_FILE_URING
+	if (ur.running && ud->req.len > 0
+			&& fd_submit (&ud->req, ud->fd, IORING_OP_WRITEV, ud->off, NULL, ud->req.len))
+		return 0;
+#endif
+	ud->req.res = fd_writev (ud->fd, ud->req.iov, ud->req.niov, ud->off);
+	return 0;
+}
+
+static int pwrite_update (lua_State *L, void *udata) {
+	pio_udata *ud = (pio_udata *)udata;
+	int ret = 1;
+	
+	if (ud->req.res < 0)
+		ud->err = -ud->req.res;
+	
+	if (ud->err) {
+		lua_pushnil (L);
+		lua_pushstring (L, strerror (ud->err));
+		ret = 2;
+	} else
+		lua_pushnumber (L, ud->req.res);
+	
+	luaL_unref (L, LUA_REGISTRYINDEX, ud->ref);
+	fd_release (L, ud->fdref);
+	free (ud);
+	return ret;
+}
+
+static const task_ops pwrite_ops = {
+	pwrite_prepare,
+	pwrite_work,
+	pwrite_update
+};
+
+/*
+ * nb_file.append (fd, data [, ...])
+ * fd:append (data [, ...])
+ * writes data at the current position (the end, if opened with "a"),
+ * and is done only when it's on disk.  data can be several pieces, as
+ * in nb_file.write().
+ * nb_file.sync (fd)
+ * fd:sync ()
+ * only waits until everything written before is on disk.
+ *
+ * concurrent appends on the same fd share the fdatasync() calls (group
+ * commit): the first one to finish writing becomes the leader, and
+ * syncs for all the tasks that are waiting, round after round, while
+ * there are new ones.  the others just detach.
+ */
+typedef struct append_udata {
+	fd_t *f;
+	int fd;
+	int ref;						/* see fd_hold() */
+	int pref;						/* and the pieces */
+	void *task;
+	struct append_udata *next;
+	ssize_t written;
+	int err;
+	struct iovec *iov;
+	int niov;
+} append_udata;
+
+static int append_new (lua_State *L, void **udata, int n) {
+	fd_t *f = check_fd (L, 1);
+	append_udata *ud;
+	size_t len;
+	
+	check_openfd (L, 1);
+	ud = (append_udata *)malloc (sizeof (append_udata) + n * sizeof (struct iovec));
+	if (!ud)
+		luaL_error (L, "can't allocate append udata");
+	*udata = ud;
+	ud->f = f;
+	ud->fd = f->fd;
+	ud->ref = fd_hold (L, 1);
+	ud->iov = (struct iovec *)(ud + 1);
+	ud->niov = n;
+	ud->pref = n > 0 ? pieces_pin (L, 2, n, ud->iov, &len) : LUA_NOREF;
+	ud->task = NULL;
+	ud->next = NULL;
+	ud->written = 0;
+	ud->err = 0;
+	return 0;
+}
+
+static int append_prepare (lua_State *L, void **udata) {
+	return append_new (L, udata, pieces_check (L, 2, lua_gettop (L) - 1));
+}
+
+static int sync_prepare (lua_State *L, void **udata) {
+	return append_new (L, udata, 0);
+}
+
+static int append_work (void *udata) {
+	append_udata *ud = (append_udata *)udata;
+	fd_t *f = ud->f;
+	append_udata *batch;
+	
+	if (ud->niov > 0) {
+		ud->written = fd_writev (ud->fd, ud->iov, ud->niov, -1);
+		if (ud->written < 0) {
+			ud->err = -ud->written;
+			return 0;
+		}
+	}
+	
+	ud->task = detach_task ();
+	if (!ud->task) {				/* run in place, nobody to leave it to */
+		if (fdatasync (ud->fd) < 0)
+			ud->err = errno;
+		return 0;
+	}
+	pthread_mutex_lock (&f->lock);
+	ud->next = f->waiting;
+	f->waiting = ud;
+	if (f->syncing) {
+		pthread_mutex_unlock (&f->lock);
+		return 0;
+	}
+	
+	f->syncing = 1;
+	while ((batch = f->waiting) != NULL) {
+		int err;
+		f->waiting = NULL;
+		pthread_mutex_unlock (&f->lock);
+		
+		err = fdatasync (ud->fd) < 0 ? errno : 0;
+		while (batch) {
+			append_udata *next = batch->next;
+			batch->err = err;
+			if (batch != ud)		/* not ours, until we're done with f */
+				complete_task (batch->task, 1);
+			batch = next;
+		}
+		pthread_mutex_lock (&f->lock);
+	}
+	f->syncing = 0;
+	pthread_mutex_unlock (&f->lock);
+	
+	complete_task (ud->task, 1);
+	return 0;
+}
+
+static int append_update (lua_State *L, void *udata) {
+	append_udata *ud = (append_udata *)udata;
+	int ret = 1;
+	
+	if (ud->err) {
+		lua_pushnil (L);
+		lua_pushstring (L, strerror (ud->err));
+		ret = 2;
+	} else
+		lua_pushnumber (L, ud->written);
+	
+	luaL_unref (L, LUA_REGISTRYINDEX, ud->pref);
+	fd_release (L, ud->ref);
+	free (ud);
+	return ret;
+}
+
+static const task_ops append_ops = {
+	append_prepare,
+	append_work,
+	append_update
+};
+
+static const task_ops sync_ops = {
+	sync_prepare,
+	append_work,
+	append_update
+};
+
+/******************************************
+ **  COPY
+ ******************************************/
+
+/*
+ * nb_file.copy (src, dst [, offset [, len [, step]]])
+ * src and dst are paths or file descriptors.  copies len bytes (default,
+ * up to the end) from offset in src, to dst's current position (a new
+ * dst file if it's a path).  the data doesn't go through user space
+ * if the kernel can avoid it: copy_file_range(), then sendfile(), then
+ * a read/write loop with a pooled buffer.
+ * with step, the task is signalled each step bytes copied.
+ */
+#define COPY_MAXSTEP	(1 << 30)		/* bytes per syscall */
+#define COPY_BUFSIZE	(256 * 1024)
+#define COPY_POOLBUFS	8
+
+static struct {
+	pthread_mutex_t lock;
+	void *bufs [COPY_POOLBUFS];
+	int n;
+} copy_pool = {PTHREAD_MUTEX_INITIALIZER};
+
+static void *copy_getbuf (void) {
+	void *buf = NULL;
+	
+	pthread_mutex_lock (&copy_pool.lock);
+	if (copy_pool.n > 0)
+		buf = copy_pool.bufs [--copy_pool.n];
+	pthread_mutex_unlock (&copy_pool.lock);
+	return buf ? buf : malloc (COPY_BUFSIZE);
+}
+
+static void copy_putbuf (void *buf) {
+	pthread_mutex_lock (&copy_pool.lock);
+	if (copy_pool.n < COPY_POOLBUFS) {
+		copy_pool.bufs [copy_pool.n++] = buf;
+		buf = NULL;
+	}
+	pthread_mutex_unlock (&copy_pool.lock);
+	free (buf);
+}
+
+enum { CP_RANGE, CP_SENDFILE, CP_RW };
+
+typedef struct copy_udata {
+	char *src, *dst;				/* paths, or NULL */
+	int srcfd, dstfd;
+	int srcref, dstref;				/* see fd_hold() */
+	off_t off;
+	size_t len;
+	int tolen;						/* len given, or up to the end */
+	size_t step;
+	size_t copied;
+	int paused;						/* in signal_task(), not done yet */
+	int cancelled;
+	int err;
+} copy_udata;
+
+static size_t copy_arg (lua_State *L, int index, int *fd) {
+	size_t len = 0;
+	
+	if (lua_type (L, index) == LUA_TSTRING)
+		lua_tolstring (L, index, &len);
+	else
+		*fd = check_openfd (L, index);
+	return len;
+}
+
+static int copy_prepare (lua_State *L, void **udata) {
+	int srcfd = -1, dstfd = -1;
+	size_t srclen = copy_arg (L, 1, &srcfd);
+	size_t dstlen = copy_arg (L, 2, &dstfd);
+	lua_Number off = lua_isnumber (L, 3) ? lua_tonumber (L, 3) : 0;
+	copy_udata *ud;
+	char *p;
+	
+	luaL_argcheck (L, off >= 0, 3, "negative offset");
+	luaL_argcheck (L, !lua_isnumber (L, 4) || lua_tonumber (L, 4) >= 0, 4, "negative length");
+	ud = (copy_udata *)malloc (sizeof (copy_udata) + srclen + dstlen + 2);
+	if (!ud)
+		luaL_error (L, "can't allocate copy udata");
+	*udata = ud;
+	
+	p = (char *)(ud + 1);
+	ud->src = ud->dst = NULL;
+	if (srcfd < 0) {
+		ud->src = p;
+		memcpy (p, lua_tostring (L, 1), srclen + 1);
+		p += srclen + 1;
+	}
+	if (dstfd < 0) {
+		ud->dst = p;
+		memcpy (p, lua_tostring (L, 2), dstlen + 1);
+	}
+	ud->srcfd = srcfd;
+	ud->dstfd = dstfd;
+	ud->srcref = srcfd >= 0 ? fd_hold (L, 1) : LUA_NOREF;
+	ud->dstref = dstfd >= 0 ? fd_hold (L, 2) : LUA_NOREF;
+	ud->off = (off_t) off;
+	ud->tolen = lua_isnumber (L, 4);
+	ud->len = ud->tolen ? (size_t) lua_tonumber (L, 4) : 0;
+	ud->step = lua_isnumber (L, 5) && lua_tonumber (L, 5) > 0 ? (size_t) lua_tonumber (L, 5) : 0;
+	ud->copied = 0;
+	ud->paused = 0;
+	ud->cancelled = 0;
+	ud->err = 0;
+	return 0;
+}
+
+/* writes all of buf at the current position */
+static int write_all (int fd, const unsigned char *buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write (fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+
+static void copy_loop (copy_udata *ud, int in, int out) {
+	int method = CP_RANGE;
+	void *buf = NULL;
+	size_t signal_at = ud->step;
+	
+	while (!ud->tolen || ud->copied < ud->len) {
+		size_t want = ud->tolen ? ud->len - ud->copied : COPY_MAXSTEP;
+		ssize_t n = -1;
+		
+		if (ud->cancelled) {
+			ud->err = ECANCELED;
+			break;
+		}
+		if (want > COPY_MAXSTEP)
+			want = COPY_MAXSTEP;
+		if (ud->step && want > ud->step)
+			want = ud->step;
+		
+		switch (method) {
+#ifdef __linux__
+			case CP_RANGE:
+				n = copy_file_range (in, &ud->off, out, NULL, want, 0);
+				if (n < 0 && (errno == EXDEV || errno == EINVAL || errno == ENOSYS
+						|| errno == EBADF || errno == EOPNOTSUPP || errno == ETXTBSY)) {
+					method = CP_SENDFILE;
+					continue;
+				}
+				break;
+			case CP_SENDFILE:
+				n = sendfile (out, in, &ud->off, want);
+				if (n < 0 && (errno == EINVAL || errno == ENOSYS)) {
+					method = CP_RW;
+					continue;
+				}
+				break;
+#endif
+			default:
+				if (!buf && !(buf = copy_getbuf ())) {
+					ud->err = ENOMEM;
+					return;
+				}
+				n = pread (in, buf, want < COPY_BUFSIZE ? want : COPY_BUFSIZE, ud->off);
+				if (n > 0 && write_all (out, buf, n) < 0)
+					n = -1;
+				else if (n > 0)
+					ud->off += n;
+				break;
+		}
+		
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			ud->err = errno;
+			break;
+		}
+		if (n == 0)
+			break;
+		ud->copied += n;
+		
+		if (ud->step && ud->copied >= signal_at && (!ud->tolen || ud->copied < ud->len)) {
+			ud->paused = 1;
+			signal_task (1);			/* until updated, so ud stays put */
+			ud->paused = 0;
+			signal_at = ud->copied + ud->step;
+		}
+	}
+	if (buf)
+		copy_putbuf (buf);
+}
+
+static int copy_work (void *udata) {
+	copy_udata *ud = (copy_udata *)udata;
+	int in = ud->srcfd, out = ud->dstfd;
+	
+	if (ud->src && (in = open (ud->src, O_RDONLY | O_CLOEXEC)) < 0) {
+		ud->err = errno;
+		return 0;
+	}
+	if (ud->dst && (out = open (ud->dst, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666)) < 0)
+		ud->err = errno;
+	else
+		copy_loop (ud, in, out);
+	
+	if (ud->src)
+		close (in);
+	if (ud->dst && out >= 0 && close (out) < 0 && !ud->err)
+		ud->err = errno;
+	return 0;
+}
+
+/*
+ * while the task is signalled, returns the bytes copied so far;
+ * when it's done, the total and true
+ */
+static int copy_update (lua_State *L, void *udata) {
+	copy_udata *ud = (copy_udata *)udata;
+	
+	if (ud->paused) {
+		lua_pushnumber (L, ud->copied);
+		return 1;
+	}
+	
+	if (ud->err) {
+		lua_pushnil (L);
+		lua_pushfstring (L, "%s", strerror (ud->err));
+	} else {
+		lua_pushnumber (L, ud->copied);
+		lua_pushboolean (L, 1);
+	}
+	fd_release (L, ud->srcref);
+	fd_release (L, ud->dstref);
+	free (ud);
+	return 2;
+}
+
+/* stops at the next step */
+static void copy_cancel (void *udata) {
+	copy_udata *ud = (copy_udata *)udata;
+	ud->cancelled = 1;
+}
+
+static const task_ops copy_ops = {
+	copy_prepare,
+	copy_work,
+	copy_update,
+	NULL,
+	TASK_IO,
+	copy_cancel
+};
+
+/******************************************
+ **  DIRECTORIES
+ ******************************************/
+
+#define DIR_BUFSIZE		(64 * 1024)
+
+/* the entries of an open directory; with getdents64() in big batches, if available */
+typedef struct dir_iter {
+	int fd;
+#ifdef __linux__
+	char *buf;
+	long pos, len;
+#else
+	DIR *d;
+#endif
+} dir_iter;
+
+#ifdef __linux__
+struct linux_dirent64 {
+	ino64_t d_ino;
+	off64_t d_off;
+	unsigned short d_reclen;
+	unsigned char d_type;
+	char d_name [1];
+};
+
+static int dir_open (dir_iter *it, int fd) {
+	it->fd = fd;
+	it->pos = it->len = 0;
+	it->buf = (char *)malloc (DIR_BUFSIZE);
+	if (!it->buf) {
+		close (fd);
+		errno = ENOMEM;
+		return 0;
+	}
+	return 1;
+}
+
+static const char *dir_next (dir_iter *it, int *type) {
+	struct linux_dirent64 *d;
+	
+	if (it->pos >= it->len) {
+		it->len = syscall (SYS_getdents64, it->fd, it->buf, DIR_BUFSIZE);
+		it->pos = 0;
+		if (it->len <= 0)
+			return NULL;
+	}
+	d = (struct linux_dirent64 *)(it->buf + it->pos);
+	it->pos += d->d_reclen;
+	*type = d->d_type;
+	return d->d_name;
+}
+
+static void dir_close (dir_iter *it) {
+	free (it->buf);
+	close (it->fd);
+}
+
+#else
+static int dir_open (dir_iter *it, int fd) {
+	it->fd = fd;
+	it->d = fdopendir (fd);
+	if (!it->d)
+		close (fd);
+	return it->d != NULL;
+}
+
+static const char *dir_next (dir_iter *it, int *type) {
+	struct dirent *d = readdir (it->d);
+	if (!d)
+		return NULL;
+	*type = d->d_type;
+	return d->d_name;
+}
+
+static void dir_close (dir_iter *it) {
+	closedir (it->d);
+}
+#endif
+
+/*
+ * nb_file.readdir (path [, opts])
+ * opts.recursive: walks the subdirectories too, in parallel on the helpers
+ * opts.batch: entries per signal (default 1024)
+ * the task is signalled with each batch of names, relative to path;
+ * those of directories end with "/".  symlinks aren't followed.
+ *
+ * the walkers add their names to a shared list, and the one that
+ * fills a batch signals the task and waits for the update to take it.
+ * so the update can tell a batch from the end: nobody is waiting.
+ */
+#define READDIR_BATCH	1024
+#define READDIR_LOCAL	64				/* names kept by a walker before adding them */
+
+typedef struct readdir_udata {
+	char *path;
+	int recursive;
+	size_t batch;
+	int dirfd;
+	void *task;
+	pthread_mutex_t lock;
+	pthread_cond_t taken;
+	buffer_t names;					/* '\0' separated */
+	size_t pending;
+	int signalled;
+	int cancelled;
+	int err;
+} readdir_udata;
+
+typedef struct readdir_job {
+	readdir_udata *ud;
+	const char *rel;				/* "" for the top */
+} readdir_job;
+
+static int readdir_prepare (lua_State *L, void **udata) {
+	size_t len;
+	const char *path = luaL_checklstring (L, 1, &len);
+	readdir_udata *ud;
+	int recursive = 0;
+	lua_Number batch = READDIR_BATCH;
+	
+	if (lua_istable (L, 2)) {
+		lua_getfield (L, 2, "recursive");
+		recursive = lua_toboolean (L, -1);
+		lua_getfield (L, 2, "batch");
+		if (lua_isnumber (L, -1) && lua_tonumber (L, -1) >= 1)
+			batch = lua_tonumber (L, -1);
+		lua_pop (L, 2);
+	}
+	
+	ud = (readdir_udata *)malloc (sizeof (readdir_udata) + len + 1);
+	if (!ud)
+		luaL_error (L, "can't allocate readdir udata");
+	*udata = ud;
+	ud->path = (char *)(ud + 1);
+	memcpy (ud->path, path, len + 1);
+	ud->recursive = recursive;
+	ud->batch = (size_t) batch;
+	ud->dirfd = -1;
+	ud->task = NULL;
+	pthread_mutex_init (&ud->lock, NULL);
+	pthread_cond_init (&ud->taken, NULL);
+	buffer_init (&ud->names);
+	ud->pending = 0;
+	ud->signalled = 0;
+	ud->cancelled = 0;
+	ud->err = 0;
+	return 0;
+}
+
+/* returns zero if the walkers should stop */
+static int readdir_add (readdir_udata *ud, buffer_t *local, size_t *n) {
+	int go;
+	
+	pthread_mutex_lock (&ud->lock);
+	buffer_add (&ud->names, (const char *)buffer_data (local), buffer_len (local));
+	ud->pending += *n;
+	if (ud->pending >= ud->batch) {
+		if (!ud->signalled) {
+			ud->signalled = 1;
+			complete_task (ud->task, 0);
+		}
+		while (ud->pending >= ud->batch)
+			pthread_cond_wait (&ud->taken, &ud->lock);
+	}
+	go = !ud->cancelled;
+	pthread_mutex_unlock (&ud->lock);
+	
+	local->end = local->data;
+	*n = 0;
+	return go;
+}
+
+static readdir_job *readdir_newjob (readdir_udata *ud, const char *rel, size_t len) {
+	readdir_job *job = (readdir_job *)malloc (sizeof (readdir_job) + len + 1);
+	if (job) {
+		char *p = (char *)(job + 1);
+		memcpy (p, rel, len);
+		p [len] = '\0';
+		job->ud = ud;
+		job->rel = p;
+	}
+	return job;
+}
+
+static int readdir_walk (void *arg);
+
+/* lists a directory, returns the number of subtasks spawned */
+static int readdir_dir (readdir_job *job) {
+	readdir_udata *ud = job->ud;
+	size_t rlen = strlen (job->rel);
+	buffer_t local;
+	size_t n = 0;
+	int spawned = 0;
+	dir_iter it;
+	const char *name;
+	int type;
+	int fd = openat (ud->dirfd, rlen ? job->rel : ".", O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+	
+	if (fd < 0 || !dir_open (&it, fd)) {
+		if (rlen == 0)
+			ud->err = errno;
+		return 0;
+	}
+	
+	buffer_init (&local);
+	while ((name = dir_next (&it, &type)) != NULL) {
+		size_t nlen = strlen (name);
+		size_t start;
+		
+		if (name [0] == '.' && (name [1] == '\0' || (name [1] == '.' && name [2] == '\0')))
+			continue;
+		if (type == DT_UNKNOWN) {
+			struct stat st;
+			if (fstatat (fd, name, &st, AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR (st.st_mode))
+				type = DT_DIR;
+		}
+		
+		start = buffer_len (&local);
+		buffer_add (&local, job->rel, rlen);
+		buffer_add (&local, name, nlen);
+		if (type == DT_DIR)
+			buffer_add (&local, "/", 1);
+		
+		if (type == DT_DIR && ud->recursive) {
+			readdir_job *sub = readdir_newjob (ud, (const char *)buffer_data (&local) + start,
+					buffer_len (&local) - start);
+			if (sub) {
+				spawn_subtask (readdir_walk, sub);
+				spawned++;
+			}
+		}
+		buffer_add (&local, "", 1);
+		if (++n >= READDIR_LOCAL && !readdir_add (ud, &local, &n))
+			break;
+	}
+	if (n > 0)
+		readdir_add (ud, &local, &n);
+	
+	buffer_free (&local);
+	dir_close (&it);
+	return spawned;
+}
+
+static int readdir_walk (void *arg) {
+	readdir_job *job = (readdir_job *)arg;
+	readdir_dir (job);
+	free (job);
+	return 0;
+}
+
+static int readdir_work (void *udata) {
+	readdir_udata *ud = (readdir_udata *)udata;
+	readdir_job top;
+	
+	ud->task = detach_task ();
+	if (!ud->task)
+		ud->batch = (size_t) -1;		/* run in place: all in one go, nobody to wait for */
+	ud->dirfd = open (ud->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (ud->dirfd < 0) {
+		ud->err = errno;
+		complete_task (ud->task, 1);
+		return 0;
+	}
+	
+	top.ud = ud;
+	top.rel = "";
+	if (readdir_dir (&top) == 0)
+		complete_task (ud->task, 1);		/* if not, the last subtask does it */
+	return 0;
+}
+
+/* each batch is an array of names; at the end, the last one and true */
+static int readdir_update (lua_State *L, void *udata) {
+	readdir_udata *ud = (readdir_udata *)udata;
+	const char *p, *end;
+	int i = 0, last;
+	
+	if (ud->err) {
+		lua_pushnil (L);
+		lua_pushfstring (L, "%s: %s", ud->path, strerror (ud->err));
+		last = 1;
+	} else {
+		pthread_mutex_lock (&ud->lock);
+		last = !ud->signalled;
+		lua_createtable (L, ud->pending, 0);
+		p = (const char *)buffer_data (&ud->names);
+		end = p + buffer_len (&ud->names);
+		while (p < end) {
+			size_t len = strlen (p);
+			lua_pushlstring (L, p, len);
+			lua_rawseti (L, -2, ++i);
+			p += len + 1;
+		}
+		ud->names.end = ud->names.data;
+		ud->pending = 0;
+		ud->signalled = 0;
+		pthread_cond_broadcast (&ud->taken);
+		pthread_mutex_unlock (&ud->lock);
+		if (!last)
+			return 1;
+		lua_pushboolean (L, 1);
+	}
+	
+	if (ud->dirfd >= 0)
+		close (ud->dirfd);
+	buffer_free (&ud->names);
+	pthread_cond_destroy (&ud->taken);
+	pthread_mutex_destroy (&ud->lock);
+	free (ud);
+	return 2;
+}
+
+/* the walkers stop with their next names */
+static void readdir_cancel (void *udata) {
+	readdir_udata *ud = (readdir_udata *)udata;
+	
+	pthread_mutex_lock (&ud->lock);
+	ud->cancelled = 1;
+	pthread_mutex_unlock (&ud->lock);
+}
+
+static const task_ops readdir_ops = {
+	readdir_prepare,
+	readdir_work,
+	readdir_update,
+	NULL,
+	TASK_IO,
+	readdir_cancel
+};
+
+/*
+ * nb_file.statmany (paths [, nofollow])
+ * stats all the paths (an array), split among the helpers if there are
+ * many.  returns an array with a table for each path, with the fields
+ * type, mode, size, mtime, ino and nlink; or false if it failed.
+ */
+#define STAT_CHUNK		256
+
+typedef struct stat_res {
+	int err;
+	struct stat st;
+} stat_res;
+
+typedef struct stat_job {
+	struct statmany_udata *ud;
+	int first, n;
+} stat_job;
+
+typedef struct statmany_udata {
+	int ref;						/* keeps the paths */
+	int flags;
+	int n;
+	struct iovec *paths;
+	stat_res *res;
+	stat_job *jobs;
+} statmany_udata;
+
+static int statmany_prepare (lua_State *L, void **udata) {
+	int n, nofollow;
+	size_t len;
+	statmany_udata *ud;
+	
+	luaL_checktype (L, 1, LUA_TTABLE);
+	nofollow = lua_isboolean (L, 2) && lua_toboolean (L, 2);
+	n = pieces_check (L, 1, 1);
+	
+	ud = (statmany_udata *)malloc (sizeof (statmany_udata) + n * sizeof (struct iovec));
+	if (!ud)
+		luaL_error (L, "can't allocate statmany udata");
+	*udata = ud;
+	ud->paths = (struct iovec *)(ud + 1);
+	ud->n = n;
+	ud->ref = pieces_pin (L, 1, n, ud->paths, &len);
+	ud->flags = nofollow ? AT_SYMLINK_NOFOLLOW : 0;
+	ud->res = NULL;
+	ud->jobs = NULL;
+	return 0;
+}
+
+static int stat_chunk (void *arg) {
+	stat_job *job = (stat_job *)arg;
+	statmany_udata *ud = job->ud;
+	int i;
+	
+	for (i = job->first; i < job->first + job->n; i++) {
+		stat_res *r = &ud->res [i];
+		r->err = fstatat (AT_FDCWD, (const char *)ud->paths [i].iov_base, &r->st, ud->flags) < 0 ? errno : 0;
+	}
+	return 0;
+}
+
+static int statmany_work (void *udata) {
+	statmany_udata *ud = (statmany_udata *)udata;
+	int njobs = (ud->n + STAT_CHUNK - 1) / STAT_CHUNK;
+	int i;
+	
+	ud->res = (stat_res *)malloc ((ud->n > 0 ? ud->n : 1) * sizeof (stat_res));
+	ud->jobs = (stat_job *)malloc ((njobs > 0 ? njobs : 1) * sizeof (stat_job));
+	if (!ud->res || !ud->jobs)
+		return 0;
+	
+	for (i = 0; i < njobs; i++) {
+		ud->jobs [i].ud = ud;
+		ud->jobs [i].first = i * STAT_CHUNK;
+		ud->jobs [i].n = i < njobs - 1 ? STAT_CHUNK : ud->n - i * STAT_CHUNK;
+	}
+	if (njobs == 1)
+		stat_chunk (&ud->jobs [0]);
+	else
+		for (i = 0; i < njobs; i++)
+			spawn_subtask (stat_chunk, &ud->jobs [i]);
+	return 0;
+}
+
+static const char *mode_type (mode_t mode) {
+	if (S_ISREG (mode))
+		return "file";
+	if (S_ISDIR (mode))
+		return "directory";
+	if (S_ISLNK (mode))
+		return "link";
+	if (S_ISSOCK (mode))
+		return "socket";
+	if (S_ISFIFO (mode))
+		return "named pipe";
+	if (S_ISCHR (mode))
+		return "char device";
+	if (S_ISBLK (mode))
+		return "block device";
+	return "other";
+}
+
+static int statmany_update (lua_State *L, void *udata) {
+	statmany_udata *ud = (statmany_udata *)udata;
+	int i, ret = 1;
+	
+	if (!ud->res || !ud->jobs) {
+		lua_pushnil (L);
+		lua_pushstring (L, strerror (ENOMEM));
+		ret = 2;
+	} else {
+		lua_createtable (L, ud->n, 0);
+		for (i = 0; i < ud->n; i++) {
+			stat_res *r = &ud->res [i];
+			if (r->err)
+				lua_pushboolean (L, 0);
+			else {
+				lua_createtable (L, 0, 6);
+				lua_pushstring (L, mode_type (r->st.st_mode));
+				lua_setfield (L, -2, "type");
+				lua_pushnumber (L, r->st.st_mode & 07777);
+				lua_setfield (L, -2, "mode");
+				lua_pushnumber (L, r->st.st_size);
+				lua_setfield (L, -2, "size");
+				lua_pushnumber (L, r->st.st_mtime);
+				lua_setfield (L, -2, "mtime");
+				lua_pushnumber (L, r->st.st_ino);
+				lua_setfield (L, -2, "ino");
+				lua_pushnumber (L, r->st.st_nlink);
+				lua_setfield (L, -2, "nlink");
+			}
+			lua_rawseti (L, -2, i+1);
+		}
+	}
+	
+	luaL_unref (L, LUA_REGISTRYINDEX, ud->ref);
+	free (ud->res);
+	free (ud->jobs);
+	free (ud);
+	return ret;
+}
+
+static const task_ops statmany_ops = {
+	statmany_prepare,
+	statmany_work,
+	statmany_update
+};
+
+/******************************************
+ **  CACHE
+ ******************************************/
+
+/*
+ * whole contents of small files, shared by all the helpers, and
+ * dropped when their bytes are needed for newer ones (LRU).  an entry
+ * is good while the file keeps its inode, size and mtime, checked by
+ * a stat() in a helper.  for a while after that check, a hit is just
+ * a hash lookup, done by nb_file.load() in the main thread without
+ * going to a helper.  entries are refcounted: an update can still be
+ * using one after it's dropped.  disabled until given a budget.
+ */
+#define CACHE_BUCKETS	1024
+#define CACHE_MAXFILE	16				/* default largest file: budget / 16 */
+#define CACHE_FRESH		1.0				/* default seconds a check is trusted */
+
+typedef struct cache_entry {
+	struct cache_entry *hnext;			/* in its bucket */
+	struct cache_entry *prev, *next;	/* LRU list, most recent first */
+	int cached;
+	int refs;
+	unsigned hash;
+	dev_t dev;
+	ino_t ino;
+	off_t size;
+	struct timespec mtime;
+	double checked;						/* last stat(), see cache_now() */
+	char *path;
+	size_t len;
+	char *data;
+} cache_entry;
+
+static struct {
+	pthread_mutex_t lock;
+	size_t budget, maxfile, used, n;
+	double fresh;
+	cache_entry *buckets [CACHE_BUCKETS];
+	cache_entry *head, *tail;
+} cache = {PTHREAD_MUTEX_INITIALIZER, 0, 0, 0, 0, CACHE_FRESH};
+
+static double cache_now (void) {
+	struct timespec ts;
+	clock_gettime (CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static unsigned cache_hash (const char *path) {
+	unsigned h = 5381;
+	while (*path)
+		h = h * 33 + (unsigned char) *path++;
+	return h;
+}
+
+/* these are called with the lock held */
+static void cache_release (cache_entry *e) {
+	if (--e->refs == 0) {
+		free (e->data);
+		free (e);
+	}
+}
+
+static void cache_unlink (cache_entry *e) {
+	cache_entry **pe = &cache.buckets [e->hash % CACHE_BUCKETS];
+	
+	while (*pe != e)
+		pe = &(*pe)->hnext;
+	*pe = e->hnext;
+	if (e->prev)
+		e->prev->next = e->next;
+	else
+		cache.head = e->next;
+	if (e->next)
+		e->next->prev = e->prev;
+	else
+		cache.tail = e->prev;
+	
+	e->cached = 0;
+	cache.used -= e->len;
+	cache.n--;
+	cache_release (e);
+}
+
+static void cache_trim (void) {
+	while (cache.tail && cache.used > cache.budget)
+		cache_unlink (cache.tail);
+}
+
+static int cache_valid (const cache_entry *e, const struct stat *st) {
+	return e->dev == st->st_dev && e->ino == st->st_ino && e->size == st->st_size
+			&& e->mtime.tv_sec == st->st_mtim.tv_sec && e->mtime.tv_nsec == st->st_mtim.tv_nsec;
+}
+
+/*
+ * returns the entry (with a new reference) if it's still good for
+ * the file's current st, or without st, if it was checked lately
+ */
+static cache_entry *cache_find (const char *path, const struct stat *st) {
+	unsigned h = cache_hash (path);
+	cache_entry *e;
+	double now = cache_now ();
+	
+	for (e = cache.buckets [h % CACHE_BUCKETS]; e; e = e->hnext)
+		if (e->hash == h && strcmp (e->path, path) == 0)
+			break;
+	if (!e)
+		return NULL;
+	if (!st) {
+		if (now - e->checked >= cache.fresh)
+			return NULL;
+	} else if (!cache_valid (e, st)) {
+		cache_unlink (e);
+		return NULL;
+	} else
+		e->checked = now;
+	
+	if (e != cache.head) {				/* to the front */
+		e->prev->next = e->next;
+		if (e->next)
+			e->next->prev = e->prev;
+		else
+			cache.tail = e->prev;
+		e->prev = NULL;
+		e->next = cache.head;
+		cache.head->prev = e;
+		cache.head = e;
+	}
+	e->refs++;
+	return e;
+}
+
+static void cache_insert (cache_entry *e) {
+	cache_entry *old;
+	
+	for (old = cache.buckets [e->hash % CACHE_BUCKETS]; old; old = old->hnext)
+		if (old->hash == e->hash && strcmp (old->path, e->path) == 0) {
+			cache_unlink (old);
+			break;
+		}
+	
+	e->hnext = cache.buckets [e->hash % CACHE_BUCKETS];
+	cache.buckets [e->hash % CACHE_BUCKETS] = e;
+	e->prev = NULL;
+	e->next = cache.head;
+	if (cache.head)
+		cache.head->prev = e;
+	else
+		cache.tail = e;
+	cache.head = e;
+	e->cached = 1;
+	e->refs++;
+	cache.used += e->len;
+	cache.n++;
+	cache_trim ();
+}
+
+/*
+ * nb_file.cache ([budget [, maxfile [, fresh]]])
+ * sets the bytes kept by the cache (0 disables it), the largest file
+ * kept (default, budget / 16), and the seconds a hit is taken without
+ * checking the file again (default 1).  returns the budget, the bytes
+ * used and the number of files cached.
+ */
+static int cache_config (lua_State *L) {
+	pthread_mutex_lock (&cache.lock);
+	if (lua_isnumber (L, 1)) {
+		lua_Number budget = lua_tonumber (L, 1);
+		cache.budget = budget > 0 ? (size_t) budget : 0;
+		cache.maxfile = lua_isnumber (L, 2) ? (size_t) lua_tonumber (L, 2) : cache.budget / CACHE_MAXFILE;
+		cache.fresh = lua_isnumber (L, 3) ? lua_tonumber (L, 3) : CACHE_FRESH;
+		cache_trim ();
+	}
+	lua_pushnumber (L, cache.budget);
+	lua_pushnumber (L, cache.used);
+	lua_pushnumber (L, cache.n);
+	pthread_mutex_unlock (&cache.lock);
+	return 3;
+}
+
+/*
+ * nb_file.load (path)
+ * reads the whole file.  with the cache enabled, a hit checked lately
+ * is done by try_inline() in the main thread, without a stat(); the
+ * others go to a helper, which checks them or fills the cache.
+ */
+typedef struct load_udata {
+	char *path;
+	cache_entry *e;
+	int err;
+} load_udata;
+
+static int load_prepare (lua_State *L, void **udata) {
+	size_t len;
+	const char *path = luaL_checklstring (L, 1, &len);
+	load_udata *ud = (load_udata *)malloc (sizeof (load_udata) + len + 1);
+	
+	if (!ud)
+		luaL_error (L, "can't allocate load udata");
+	*udata = ud;
+	ud->path = (char *)(ud + 1);
+	memcpy (ud->path, path, len + 1);
+	ud->e = NULL;
+	ud->err = 0;
+	return 0;
+}
+
+static int load_try_inline (void *udata) {
+	load_udata *ud = (load_udata *)udata;
+	
+	pthread_mutex_lock (&cache.lock);
+	if (cache.budget > 0)
+		ud->e = cache_find (ud->path, NULL);
+	pthread_mutex_unlock (&cache.lock);
+	return ud->e != NULL;
+}
+
+/* reads into a new entry, with a reference for ud */
+static int load_work (void *udata) {
+	load_udata *ud = (load_udata *)udata;
+	size_t plen = strlen (ud->path);
+	cache_entry *e;
+	struct stat st;
+	size_t cap;
+	double checked = cache_now ();
+	int fd = open (ud->path, O_RDONLY | O_CLOEXEC);
+	
+	if (fd < 0 || fstat (fd, &st) < 0) {
+		ud->err = errno;
+		if (fd >= 0)
+			close (fd);
+		return 0;
+	}
+	pthread_mutex_lock (&cache.lock);
+	if (cache.budget > 0)
+		ud->e = cache_find (ud->path, &st);
+	pthread_mutex_unlock (&cache.lock);
+	if (ud->e) {
+		close (fd);
+		return 0;
+	}
+	
+	/* one byte more than the size, to see the end without growing it */
+	e = (cache_entry *)malloc (sizeof (cache_entry) + plen + 1);
+	cap = st.st_size > 0 ? (size_t) st.st_size + 1 : 8192;
+	if (!e || !(e->data = (char *)malloc (cap))) {
+		free (e);
+		close (fd);
+		ud->err = ENOMEM;
+		return 0;
+	}
+	e->len = 0;
+	for (;;) {
+		ssize_t n;
+		if (e->len == cap) {
+			char *data = (char *)realloc (e->data, cap * 2);
+			if (!data) {
+				ud->err = ENOMEM;
+				break;
+			}
+			e->data = data;
+			cap *= 2;
+		}
+		n = read (fd, e->data + e->len, cap - e->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0)
+			ud->err = errno;
+		if (n <= 0)
+			break;
+		e->len += n;
+	}
+	close (fd);
+	if (e->len < cap) {					/* only what's used counts for the budget */
+		char *data = (char *)realloc (e->data, e->len > 0 ? e->len : 1);
+		if (data)
+			e->data = data;
+	}
+	
+	e->path = (char *)(e + 1);
+	memcpy (e->path, ud->path, plen + 1);
+	e->hash = cache_hash (e->path);
+	e->dev = st.st_dev;
+	e->ino = st.st_ino;
+	e->size = st.st_size;
+	e->mtime = st.st_mtim;
+	e->checked = checked;
+	e->cached = 0;
+	e->refs = 1;
+	ud->e = e;
+	
+	if (!ud->err && S_ISREG (st.st_mode) && e->len == (size_t) st.st_size) {
+		pthread_mutex_lock (&cache.lock);
+		if (cache.budget > 0 && e->len <= cache.maxfile && e->len <= cache.budget)
+			cache_insert (e);
+		pthread_mutex_unlock (&cache.lock);
+	}
+	return 0;
+}
+
+static int load_update (lua_State *L, void *udata) {
+	load_udata *ud = (load_udata *)udata;
+	int ret = 1;
+	
+	if (ud->err) {
+		lua_pushnil (L);
+		lua_pushfstring (L, "%s: %s", ud->path, strerror (ud->err));
+		ret = 2;
+	} else
+		lua_pushlstring (L, ud->e->data, ud->e->len);
+	
+	if (ud->e) {
+		pthread_mutex_lock (&cache.lock);
+		cache_release (ud->e);
+		pthread_mutex_unlock (&cache.lock);
+	}
+	free (ud);
+	return ret;
+}
+
+static const task_ops load_ops = {
+	load_prepare,
+	load_work,
+	load_update,
+	load_try_inline
+};
+
+/***************************************
+ **  Initialization
+ ***************************************/
+
+static const struct luaL_reg map_meths [] = {
+	{"sub", map_sub},
+	{"len", map_len},
+	{"find", map_find},
+	{"close", map_close},
+	{"__len", map_len},
+	{"__tostring", map_tostring},
+	{"__gc", map_close},
+	{NULL, NULL}
+};
+
+static const struct luaL_reg fd_meths [] = {
+	{"close", fd_close},
+	{"__tostring", fd_tostring},
+	{"__gc", fd_gc},
+	{NULL, NULL}
+};
+
+static const task_reg fd_tasks [] = {
+	{"pread", &pread_ops},
+	{"pwrite", &pwrite_ops},
+	{"append", &append_ops},
+	{"sync", &sync_ops},
+	{NULL}
+};
+
+static const task_reg nb_file_reg [] = {
+	{"read", &read_ops},
+	{"write", &write_ops},
+	{"map", &map_ops},
+	{"scan", &scan_ops},
+	{"open", &open_ops},
+	{"pread", &pread_ops},
+	{"pwrite", &pwrite_ops},
+	{"copy", &copy_ops},
+	{"append", &append_ops},
+	{"sync", &sync_ops},
+	{"readdir", &readdir_ops},
+	{"statmany", &statmany_ops},
+	{"load", &load_ops},
+	{NULL}
+};
+
+/*
+ * nb_file.backend ()
+ * "io_uring" or "threads"
+ */
+static int backend (lua_State *L) {
+#ifdef NB_FILE_URING
+	if (ur.running) {
+		lua_pushliteral (L, "io_uring");
+		return 1;
+	}
+#endif
+	lua_pushliteral (L, "threads");
+	return 1;
+}
+
+int luaopen_nb_file (lua_State *L);
+int luaopen_nb_file (lua_State *L) {
+	helper_init (L);
+	
+#ifdef NB_FILE_URING
+	if (!ur.running && uring_start ()) {
+		lua_newuserdata (L, 1);
+		lua_newtable (L);
+		lua_pushcfunction (L, uring_gc);
+		lua_setfield (L, -2, "__gc");
+		lua_setmetatable (L, -2);
+		luaL_ref (L, LUA_REGISTRYINDEX);
+	}
+#endif
+	
+	luaL_newmetatable(L, MapType);
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -3);
+	luaL_openlib (L, NULL, map_meths, 0);
+	
+	luaL_newmetatable(L, FdType);
+	lua_pushliteral(L, "__index");
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -3);
+	luaL_openlib (L, NULL, fd_meths, 0);
+	tasklib (L, NULL, fd_tasks);
+	
 	tasklib (L, "nb_file", nb_file_reg);
+	lua_pushcfunction (L, backend);
+	lua_setfield (L, -2, "backend");
+	lua_pushcfunction (L, cache_config);
+	lua_setfield (L, -2, "cache");
 	
 	return 1;
 }
@@ -0,0 +1,32 @@
+/*
+ * Helper Threads Toolkit
+ * (c) 2006 Javier Guerra G.
+ * $Id: nb_file.h,v 1.1 2007-07-31 23:53:34 jguerra Exp $
+ */
+
+/*
+ * kernels for nb_file.scan().  the file is mapped and cut in chunks
+ * that end on a newline; scan() is called for each chunk by the
+ * helpers (several at the same time), with a result area of size
+ * bytes, zeroed.  then the update merges the results in file order
+ * into a zeroed one, and push() leaves the final value on the stack.
+ *
+ * another C library can pass its own kernel to nb_file.scan() as a
+ * light userdata pointing to a static scan_kernel.
+ */
+
+typedef struct scan_chunk {
+	const unsigned char *p;		/* the chunk, in the file's map */
+	size_t len;
+	size_t tail;				/* bytes after the chunk, up to the end of file */
+	off_t off;					/* of p in the file */
+	const char *arg;			/* the 'arg' option, or NULL */
+	size_t arglen;
+} scan_chunk;
+
+typedef struct scan_kernel {
+	size_t size;
+	void (*scan) (const scan_chunk *c, void *res);
+	void (*merge) (void *acc, const void *res);
+	int (*push) (lua_State *L, const void *acc);
+} scan_kernel;
@@ -0,0 +1,179 @@
+require "helper"
+require "sched"
+require "nb_file"
+
+-- run it with nb_file built with and without NB_FILE_URING:
+-- the results have to be the same on both backends
+print ("backend:", nb_file.backend ())
+
+local dir = os.tmpname ()
+os.remove (dir)
+assert (os.execute ("mkdir " .. dir) == 0)
+
+local function path (name) return dir .. "/" .. name end
+local function put (name, s) local f = assert (io.open (path (name), "w")) f:write (s) f:close () end
+local function slurp (name) local f = assert (io.open (path (name))) local s = f:read ("*a") f:close () return s end
+
+local lines = {}
+for i = 1, 20000 do lines [i] = "line " .. i .. (i % 7 == 0 and " needle" or "") end
+local text = table.concat (lines, "\n") .. "\n"
+put ("text", text)
+
+local function test (name, f)
+	sched.add_thread (f)
+	sched.run ()
+	print (name .. ": ok")
+end
+
+test ("read lines", function ()
+	local f = io.open (path ("text"))
+	assert (sched.yield (nb_file.read (f, "*l")) == "line 1")
+	local n, last = 1, nil
+	while true do
+		local t = sched.yield (nb_file.read (f, "*L", 1000))
+		if not t then break end
+		assert (#t <= 1000)
+		n, last = n + #t, t [#t]
+	end
+	assert (n == 20000 and last == lines [20000])
+	f:close ()
+end)
+
+test ("map", function ()
+	local m = assert (sched.yield (nb_file.map (path ("text"), {advice = "sequential"})))
+	assert (#m == #text and m:sub (0, 6) == "line 1")
+	assert (m:find ("line 77 ") == text:find ("line 77 ", 1, true) - 1)
+	assert (m:find ("nothere") == nil)
+	m:close ()
+	assert (not pcall (m.sub, m, 0, 1))
+end)
+
+test ("pread and pwrite", function ()
+	local fd = assert (sched.yield (nb_file.open (path ("pw"), "w+")))
+	assert (sched.yield (fd:pwrite (5, "world")) == 5)
+	assert (sched.yield (fd:pwrite (0, "he", "llo")) == 5)
+	-- in parallel on different regions
+	local n = 0
+	for i = 0, 9 do
+		sched.add_thread (function ()
+			assert (sched.yield (fd:pwrite (10 + i * 3, string.format ("%03d", i))) == 3)
+			n = n + 1
+		end)
+	end
+	while n < 10 do sched.yield (helper.null ()) end
+	assert (sched.yield (fd:pread (0, 12)) == "helloworld00")
+	assert (sched.yield (fd:pread (37, 10)) == "009")
+	assert (sched.yield (fd:pread (100, 10)) == nil)
+	-- updated while 'Ready', it's done right here
+	assert (helper.update (fd:pread (5, 5)) == "world")
+	-- closed while a task still uses it: the close() waits for it
+	local t = fd:pread (0, 5)
+	fd:close ()
+	assert (sched.yield (t) == "hello")
+	assert (not pcall (fd.pread, fd, 0, 1))
+end)
+
+test ("scan", function ()
+	local _, nl = text:gsub ("\n", "")
+	local _, needles = text:gsub ("needle", "")
+	assert (sched.yield (nb_file.scan (path ("text"), 4096)) == nl)
+	assert (sched.yield (nb_file.scan (path ("text"), 4096, {kernel = "count", arg = "needle"})) == needles)
+	-- the first match, whatever chunk finishes first
+	assert (sched.yield (nb_file.scan (path ("text"), 1000, {kernel = "find", arg = "needle"}))
+		== text:find ("needle", 1, true) - 1)
+	-- across chunk boundaries
+	local _, c = text:gsub ("\nline 1", "")
+	assert (sched.yield (nb_file.scan (path ("text"), 100, {kernel = "count", arg = "\nline 1"})) == c)
+end)
+
+test ("copy", function ()
+	local n, done = sched.yield (nb_file.copy (path ("text"), path ("copy")))
+	assert (n == #text and done and slurp ("copy") == text)
+	local t = nb_file.copy (path ("text"), path ("copy2"), 0, nil, 50000)
+	local steps = 0
+	while true do
+		local c, fin = sched.yield (t)
+		if fin then assert (c == #text) break end
+		steps = steps + 1
+		assert (c == steps * 50000)
+	end
+	assert (steps == math.floor ((#text - 1) / 50000) and slurp ("copy2") == text)
+end)
+
+test ("group commit", function ()
+	local fd = assert (sched.yield (nb_file.open (path ("log"), "a")))
+	local n = 0
+	for i = 1, 100 do
+		sched.add_thread (function ()
+			assert (sched.yield (fd:append ("rec ", tostring (i), "\n")) == #("rec " .. i .. "\n"))
+			n = n + 1
+		end)
+	end
+	while n < 100 do sched.yield (helper.null ()) end
+	local t = fd:sync ()
+	fd:close ()
+	assert (sched.yield (t) == 0)
+	local s = slurp ("log")
+	for i = 1, 100 do assert (s:find ("rec " .. i .. "\n", 1, true)) end
+end)
+
+test ("readdir", function ()
+	assert (os.execute ("mkdir " .. path ("tree") .. " " .. path ("tree/sub")) == 0)
+	for i = 1, 25 do put ("tree/f" .. i, "") put ("tree/sub/g" .. i, "") end
+	local t = nb_file.readdir (path ("tree"), {recursive = true, batch = 10})
+	local all, batches = {}, 0
+	repeat
+		local names, fin = sched.yield (t)
+		assert (names, fin)
+		batches = batches + 1
+		for _, name in ipairs (names) do all [name] = true end
+	until fin
+	assert (all ["sub/"] and all ["f25"] and all ["sub/g1"])
+	local count = 0
+	for _ in pairs (all) do count = count + 1 end
+	assert (count == 51 and batches >= 2)		-- each walker adds its names at once
+	-- updated while 'Ready', it's listed right here, in one batch
+	local names, fin = helper.update (nb_file.readdir (path ("tree"), {recursive = true, batch = 10}))
+	assert (#names == 51 and fin)
+	local x, err = sched.yield (nb_file.readdir (path ("nothere")))
+	assert (x == nil and err)
+end)
+
+test ("load cache", function ()
+	put ("conf", "hello")
+	nb_file.cache (1000)
+	assert (sched.yield (nb_file.load (path ("conf"))) == "hello")
+	local t = nb_file.load (path ("conf"))
+	assert (helper.tryinline (t))					-- a hit, no trip to a helper
+	assert (helper.update (t) == "hello")
+	put ("conf", "changed!")
+	-- checked lately, so taken as is, without a stat()
+	assert (sched.yield (nb_file.load (path ("conf"))) == "hello")
+	-- done by a helper (here, in place), it's checked again
+	assert (helper.update (nb_file.load (path ("conf"))) == "changed!")
+	assert (select (2, nb_file.cache ()) == 8)
+	nb_file.cache (0)
+end)
+
+test ("read ahead", function ()
+	for _, size in ipairs {4096, 1000} do
+		local f = io.open (path ("text"))
+		local got = {}
+		while true do
+			local blk = sched.yield (nb_file.read (f, size))
+			if not blk then break end
+			got [#got+1] = blk
+		end
+		assert (table.concat (got) == text)
+		-- a seek in the middle of a streak drops what was read ahead
+		f:seek ("set", 10)
+		for i = 0, 3 do
+			assert (sched.yield (nb_file.read (f, size)) == text:sub (11 + i * size, 10 + (i + 1) * size))
+		end
+		f:seek ("set", 3)
+		assert (sched.yield (nb_file.read (f, size)) == text:sub (4, 3 + size))
+		f:close ()
+	end
+end)
+
+os.execute ("rm -r " .. dir)
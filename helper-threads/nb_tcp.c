@@ -5,16 +5,25 @@
  */
 
 
+#define _GNU_SOURCE
 #include <stdlib.h>
-#define __USE_POSIX	1
+#include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
 
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <netinet/in.h>
 #include <netinet/ip.h>
 #include <netdb.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -24,6 +33,15 @@
 #ifndef MIN
 #define MIN(a,b)	((a)<(b) ? (a) : (b))
 #endif
+#ifndef MAX
+#define MAX(a,b)	((a)>(b) ? (a) : (b))
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL	0
+#endif
+
+#define TCP_RBUFSIZE	4096
 
 /*************************
  * mem pipe, a char FIFO or stream
@@ -80,6 +98,7 @@ static void pipe_makespace (pipe_t *p, size_t l) {
 		if (new_data == NULL)
 			return;					/* error, return untouched */
 		memcpy (new_data, p->head, len);
+		free (p->data);
 		p->data = new_data;
 		p->bufsize = newbufsize;
 	}
@@ -109,14 +128,361 @@ static size_t pipe_push (pipe_t *p, const char *d, size_t l) {
 	return l;
 }
 
+
+/***********************************
+ * readiness reactor
+ *
+ * sockets are nonblocking.  a task tries its I/O on the helper; if
+ * it would block, the task is detached and a waiter is left on the
+ * socket, armed one-shot in a single epoll set.  the reactor thread
+ * retries the I/O once the socket is ready and completes the task,
+ * so an idle connection doesn't hold any helper.  without epoll the
+ * helper just waits with poll().
+ ***********************************/
+typedef struct rx_wait {
+	int (*ready) (struct rx_wait *w);	/* retries the I/O, 1 when done */
+	int offload;				/* retried on a helper instead of the reactor */
+	void *task;
+	int err;
+	struct rx_sock *s;			/* where it's waiting */
+	int out;
+} rx_wait;
+
+typedef struct rx_sock {
+	int fd;
+	int armed;					/* already in the epoll set */
+	rx_wait *rd, *wr;
+	int pending;				/* tasks using it, counted on the Lua side */
+	int closing;
+} rx_sock;
+
+static void rx_init (rx_sock *s, int fd) {
+	s->fd = fd;
+	s->armed = 0;
+	s->rd = s->wr = NULL;
+	s->pending = 0;
+	s->closing = 0;
+}
+
+static void rx_wait_init (rx_wait *w, int (*ready) (rx_wait *w), int offload) {
+	w->ready = ready;
+	w->offload = offload;
+	w->task = NULL;
+	w->err = 0;
+	w->s = NULL;
+	w->out = 0;
+}
+
+static int set_nonblock (int fd) {
+	int flags = fcntl (fd, F_GETFL);
+	if (flags < 0 || fcntl (fd, F_SETFL, flags | O_NONBLOCK) < 0)
+		return errno;
+	return 0;
+}
+
+#ifdef __linux__
+#define RX_EVENTS	64
+
+static struct {
+	pthread_mutex_t lock;
+	pthread_t pth;
+	int running, stop;
+	int epfd, efd;
+} rx = {PTHREAD_MUTEX_INITIALIZER};
+
+/* arms the socket for its waiters, with the lock held */
+static int rx_rearm (rx_sock *s) {
+	struct epoll_event ev;
+
+	if (!s->rd && !s->wr)
+		return 0;
+
+	ev.events = EPOLLONESHOT | (s->rd ? EPOLLIN | EPOLLRDHUP : 0) | (s->wr ? EPOLLOUT : 0);
+	ev.data.ptr = s;
+	if (epoll_ctl (rx.epfd, s->armed ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, s->fd, &ev) < 0)
+		return errno;
+	s->armed = 1;
+	return 0;
+}
+
+/* takes the waiters off the socket, failing them with err */
+static int rx_drop (rx_sock *s, rx_wait **done, int n, int err) {
+	if (s->rd) {
+		s->rd->err = err;
+		done [n++] = s->rd;
+		s->rd = NULL;
+	}
+	if (s->wr) {
+		s->wr->err = err;
+		done [n++] = s->wr;
+		s->wr = NULL;
+	}
+	return n;
+}
+
+/* leaves a detached task waiting on its socket */
+static void rx_arm (rx_wait *w) {
+	rx_sock *s = w->s;
+	rx_wait **slot = w->out ? &s->wr : &s->rd;
+	int err;
+
+	pthread_mutex_lock (&rx.lock);
+	if (*slot)
+		err = EBUSY;				/* another task on the same direction */
+	else {
+		*slot = w;
+		if ((err = rx_rearm (s)) != 0)
+			*slot = NULL;
+	}
+	pthread_mutex_unlock (&rx.lock);
+
+	if (err) {
+		w->err = err;
+		complete_task (w->task, 1);
+	}
+}
+
+/* an offloaded waiter, retried by a helper */
+static int rx_job (void *arg) {
+	rx_wait *w = (rx_wait *)arg;
+
+	if (w->ready (w))
+		complete_task (w->task, 1);
+	else
+		rx_arm (w);
+	return 0;
+}
+
+/*
+ * takes a ready waiter off its slot.  an offloaded one is handed to a
+ * helper and leaves the slot free, for its rx_job() to arm again;  the
+ * others are retried here without the lock, their slots keep rx_busy
+ * meanwhile so rx_arm() still finds them taken
+ */
+static rx_wait rx_busy;
+
+static rx_wait *rx_take (rx_wait **slot, rx_wait **jobs, int *nj) {
+	rx_wait *w = *slot;
+
+	if (w->offload) {
+		jobs [(*nj)++] = w;
+		*slot = NULL;
+		return NULL;
+	}
+	*slot = &rx_busy;
+	return w;
+}
+
+/* returns the waiter if it has to wait again */
+static rx_wait *rx_retry (rx_wait *w, rx_wait **done, int *n) {
+	if (w && w->ready (w)) {
+		done [(*n)++] = w;
+		return NULL;
+	}
+	return w;
+}
+
+static void rx_ready (rx_sock *s, unsigned int events) {
+	rx_wait *rd = NULL, *wr = NULL, *done [4], *jobs [2];
+	int n = 0, nj = 0, i, err;
+
+	pthread_mutex_lock (&rx.lock);
+	if (s->rd && (events & (EPOLLIN | EPOLLRDHUP | EPOLLHUP | EPOLLERR)))
+		rd = rx_take (&s->rd, jobs, &nj);
+	if (s->wr && (events & (EPOLLOUT | EPOLLHUP | EPOLLERR)))
+		wr = rx_take (&s->wr, jobs, &nj);
+	pthread_mutex_unlock (&rx.lock);
+
+	rd = rx_retry (rd, done, &n);
+	wr = rx_retry (wr, done, &n);
+
+	pthread_mutex_lock (&rx.lock);
+	if (s->rd == &rx_busy)
+		s->rd = rd;
+	if (s->wr == &rx_busy)
+		s->wr = wr;
+	if ((err = rx_rearm (s)) != 0)
+		n = rx_drop (s, done, n, err);
+	pthread_mutex_unlock (&rx.lock);
+
+	/* the socket can go away once its tasks are done */
+	for (i = 0; i < nj; i++)
+		if (!post_job (rx_job, jobs [i]))
+			rx_job (jobs [i]);
+	for (i = 0; i < n; i++)
+		complete_task (done [i]->task, 1);
+}
+
+static void *rx_service (void *arg) {
+	struct epoll_event evs [RX_EVENTS];
+
+	while (!rx.stop) {
+		int i, n = epoll_wait (rx.epfd, evs, RX_EVENTS, -1);
+		for (i = 0; i < n; i++)
+			if (evs [i].data.ptr)
+				rx_ready ((rx_sock *)evs [i].data.ptr, evs [i].events);
+	}
+	return NULL;
+}
+
+/* with the lock held */
+static int rx_start (void) {
+	struct epoll_event ev;
+	int ret;
+
+	if (rx.running)
+		return 0;
+
+	rx.epfd = epoll_create1 (EPOLL_CLOEXEC);
+	if (rx.epfd < 0)
+		return errno;
+	rx.efd = eventfd (0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (rx.efd < 0) {
+		ret = errno;
+		close (rx.epfd);
+		return ret;
+	}
+	ev.events = EPOLLIN;
+	ev.data.ptr = NULL;
+	epoll_ctl (rx.epfd, EPOLL_CTL_ADD, rx.efd, &ev);
+
+	rx.stop = 0;
+	ret = pthread_create (&rx.pth, NULL, rx_service, NULL);
+	if (ret != 0) {
+		close (rx.efd);
+		close (rx.epfd);
+		return ret;
+	}
+	rx.running = 1;
+	return 0;
+}
+
+/* joins the reactor before the library is unloaded */
+static int rx_gc (lua_State *L) {
+	uint64_t one = 1;
+
+	pthread_mutex_lock (&rx.lock);
+	if (!rx.running) {
+		pthread_mutex_unlock (&rx.lock);
+		return 0;
+	}
+	rx.stop = 1;
+	if (write (rx.efd, &one, sizeof (one)) < 0)
+		;
+	pthread_mutex_unlock (&rx.lock);
+
+	pthread_join (rx.pth, NULL);
+	close (rx.efd);
+	close (rx.epfd);
+	rx.running = 0;
+	return 0;
+}
+
+/*
+ * leaves the detached task waiting on the reactor.  returns 0 if
+ * there's no reactor, or no task (it's run in place), and the caller
+ * should wait by itself
+ */
+static int rx_wait_for (rx_sock *s, int out, rx_wait *w) {
+	int err;
+
+	if (!w->task)
+		return 0;
+
+	pthread_mutex_lock (&rx.lock);
+	err = rx_start ();
+	pthread_mutex_unlock (&rx.lock);
+	if (err)
+		return 0;
+
+	w->s = s;
+	w->out = out;
+	rx_arm (w);
+	return 1;
+}
+
+/* takes it out of the epoll set, before its rx_sock goes away */
+static void rx_forget (rx_sock *s) {
+	pthread_mutex_lock (&rx.lock);
+	if (s->armed)
+		epoll_ctl (rx.epfd, EPOLL_CTL_DEL, s->fd, NULL);
+	s->armed = 0;
+	pthread_mutex_unlock (&rx.lock);
+}
+
+#else
+static int rx_wait_for (rx_sock *s, int out, rx_wait *w) {
+	return 0;
+}
+
+static void rx_forget (rx_sock *s) {
+}
+#endif
+
+/*
+ * runs a task's I/O from work(): right now, on the reactor, or waiting
+ * here.  it detaches even when the I/O is ready at once: the next time
+ * it could wait for the peer, so it must never look cheap enough to be
+ * run inline by the Lua thread
+ */
+static void rx_run (rx_sock *s, int out, rx_wait *w) {
+	struct pollfd pfd;
+
+	w->task = detach_task ();
+	if (!w->ready (w)) {
+		if (rx_wait_for (s, out, w))
+			return;
+
+		pfd.fd = s->fd;
+		pfd.events = out ? POLLOUT : POLLIN;
+		do {
+			if (poll (&pfd, 1, -1) < 0 && errno != EINTR) {
+				w->err = errno;
+				break;
+			}
+		} while (!w->ready (w));
+	}
+	complete_task (w->task, 1);
+}
+
+/*
+ * a task pins its socket object until the update.  close() on a busy
+ * socket only shuts it down, which wakes the tasks; the last one
+ * closes the descriptor
+ */
+static void sock_close (rx_sock *s) {
+	if (s->fd < 0)
+		return;
+	if (s->pending > 0) {
+		shutdown (s->fd, SHUT_RDWR);
+		s->closing = 1;
+		return;
+	}
+	close (s->fd);
+	s->fd = -1;
+}
+
+static int sock_pin (lua_State *L, rx_sock *s) {
+	s->pending++;
+	lua_pushvalue (L, 1);
+	return luaL_ref (L, LUA_REGISTRYINDEX);
+}
+
+static void sock_unpin (lua_State *L, rx_sock *s, int ref) {
+	if (--s->pending == 0 && s->closing)
+		sock_close (s);
+	luaL_unref (L, LUA_REGISTRYINDEX, ref);
+}
+
 /***********************************/
 static const char ServerPortType[] = "__ServerPortType__";
 static const char TCPStreamType[] = "__TCPStreamType__";
 
 typedef struct tcpstream_t {
-	int fd;
+	rx_sock s;
 	struct sockaddr_in myaddr, remaddr;
 	pipe_t r;
+	int eof;
 } tcpstream_t;
 
 static tcpstream_t *check_tcpstream (lua_State *L, int index) {
@@ -126,7 +492,7 @@ static tcpstream_t *check_tcpstream (lua_State *L, int index) {
 }
 
 typedef struct serverport_t {
-	int fd;
+	rx_sock s;
 	struct sockaddr_in myaddr;
 } serverport_t;
 
@@ -137,174 +503,245 @@ static serverport_t *check_serverport (lua_State *L, int index) {
 }
 
 /***********************************/
-static int new_tcpstream (lua_State *L, tcpstream_t *in_tcps) {
+static int new_tcpstream (lua_State *L, int fd,
+		const struct sockaddr_in *myaddr, const struct sockaddr_in *remaddr) {
 	tcpstream_t *tcps = (tcpstream_t *)lua_newuserdata (L, sizeof (tcpstream_t));
 	if (!tcps) {
+		close (fd);
 		lua_pushnil (L);
 		lua_pushliteral (L, "can't alloc userdata");
 		return 2;
 	}
-	
-	*tcps = *in_tcps;
-	
+
+	rx_init (&tcps->s, fd);
+	tcps->myaddr = *myaddr;
+	tcps->remaddr = *remaddr;
+	pipe_init (&tcps->r, 0);
+	tcps->eof = 0;
+
 	luaL_getmetatable (L, TCPStreamType);
 	lua_setmetatable (L, -2);
 	return 1;
 }
 
 /********************************
-  nb_tcp.newserver (tcpport)
+  nb_tcp.newserver (tcpport [, backlog])
   new server port
  ********************************/
-static int newserver (lua_State *L) {
-	u_int16_t port = luaL_checkint (L, 1);
+static int set_reuse (int fd, int reuseport) {
+	int on = 1;
+
+	if (setsockopt (fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof (on)) < 0)
+		return -1;
+	if (!reuseport)
+		return 0;
+#ifdef SO_REUSEPORT
+	return setsockopt (fd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof (on));
+#else
+	errno = ENOPROTOOPT;
+	return -1;
+#endif
+}
+
+/* pushes a listening server port, or nil and a message */
+static int open_server (lua_State *L, u_int16_t port, int backlog, int reuseport) {
+	int fd;
 	serverport_t *sp = (serverport_t *)lua_newuserdata (L, sizeof (serverport_t));
 	if (!sp) {
 		lua_pushnil (L);
 		lua_pushliteral (L, "can't alloc userdata");
 		return 2;
 	}
-	
-	sp->fd = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (sp->fd <= 0) {
-		free (sp);
+
+	fd = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
+	if (fd < 0) {
 		lua_pushnil (L);
 		lua_pushstring (L, strerror (errno));
 		return 2;
 	}
-	setsockopt (sp->fd, SOL_SOCKET, SO_REUSEADDR, NULL, 0);
-	
+
+	memset (&sp->myaddr, 0, sizeof (sp->myaddr));
 	sp->myaddr.sin_family = AF_INET;
-	sp->myaddr.sin_port = ntohs (port);
+	sp->myaddr.sin_port = htons (port);
 	sp->myaddr.sin_addr.s_addr = INADDR_ANY;
-	
-	if (bind (sp->fd, (struct sockaddr *)&sp->myaddr, sizeof (sp->myaddr)) <0 ) {
-		close (sp->fd);
-		free(sp);
+
+	if (set_reuse (fd, reuseport) < 0
+			|| bind (fd, (struct sockaddr *)&sp->myaddr, sizeof (sp->myaddr)) < 0
+			|| listen (fd, backlog) < 0
+			|| set_nonblock (fd) != 0) {
+		int err = errno;
+		close (fd);
 		lua_pushnil (L);
-		lua_pushstring (L, strerror (errno));
+		lua_pushstring (L, strerror (err));
 		return 2;
 	}
-	
+	rx_init (&sp->s, fd);
+
 	luaL_getmetatable (L, ServerPortType);
 	lua_setmetatable (L, -2);
 	return 1;
 }
 
+static int newserver (lua_State *L) {
+	u_int16_t port = luaL_checkint (L, 1);
+	int backlog = luaL_optint (L, 2, SOMAXCONN);
+
+	return open_server (L, port, backlog, 0);
+}
+
+/*
+ * nb_tcp.newservers (tcpport, n [, backlog])
+ * n server ports on the same port, the kernel spreads the
+ * incoming connections between them
+ */
+static int newservers (lua_State *L) {
+	u_int16_t port = luaL_checkint (L, 1);
+	int n = luaL_checkint (L, 2);
+	int backlog = luaL_optint (L, 3, SOMAXCONN);
+	int i;
+
+	luaL_argcheck (L, n > 0, 2, "at least one server");
+	luaL_argcheck (L, port > 0, 1, "needs a fixed port");
+
+	lua_newtable (L);
+	for (i = 1; i <= n; i++) {
+		if (open_server (L, port, backlog, 1) != 1)
+			return 2;
+		lua_rawseti (L, -2, i);
+	}
+	return 1;
+}
+
 /*****************************************************
   nb_tcp.newclient (remaddr, remport [, localport])
  *****************************************************/
 typedef struct newclient_udata  {
+	rx_wait w;
+	rx_sock s;
 	char *hostname;
 	u_int16_t remport, localport;
-	tcpstream_t new;
-	int err;
+	struct sockaddr_in remaddr;
 } newclient_udata;
 
-/* #define STACKBUFSIZE 512 */
-
 static int resolve (const char *name, struct in_addr *addr) {
 	struct addrinfo hints, *res;
 	int err;
-	
-	hints.ai_flags = 0;
+
+	memset (&hints, 0, sizeof (hints));
 	hints.ai_family = AF_INET;
 	hints.ai_socktype = SOCK_STREAM;
 	hints.ai_protocol = IPPROTO_TCP;
-	hints.ai_addrlen = sizeof (*addr);
-	
+
 	err = getaddrinfo (name, NULL, &hints, &res);
-	if (!err)
-		memcpy (addr, res->ai_addr, sizeof (*addr));
-	
-	freeaddrinfo (res);
-	return err;
-	
-/*	char buf [STACKBUFSIZE];
-	struct hostent he, *result;
-	int err;
-	
-	if (gethostbyname2_r (name, AF_INET, &he, buf, STACKBUFSIZE, &result, &err))
+	if (err)
 		return err;
-	
-	memcpy (addr, result, sizeof (*addr));
-	return err;*/
+
+	*addr = ((struct sockaddr_in *)res->ai_addr)->sin_addr;
+	freeaddrinfo (res);
+	return 0;
+}
+
+/* connect() again tells if it's still going on */
+static int newclient_ready (rx_wait *w) {
+	newclient_udata *ud = (newclient_udata *)w;
+
+	if (connect (ud->s.fd, (struct sockaddr *)&ud->remaddr, sizeof (ud->remaddr)) == 0
+			|| errno == EISCONN)
+		return 1;
+	if (errno == EINPROGRESS || errno == EALREADY || errno == EINTR)
+		return 0;
+	w->err = errno;
+	return 1;
 }
 
 static int newclient_prepare (lua_State *L, void **udata) {
 	size_t namelen;
 	const char *hostname = luaL_checklstring (L, 1, &namelen);
 	u_int16_t remport = luaL_checkint (L, 2);
-	u_int16_t localport = luaL_optint (L, 3, 0);
+	u_int16_t localport = lua_isnumber (L, 3) ? lua_tointeger (L, 3) : 0;
 	newclient_udata *ud = (newclient_udata *)malloc (sizeof (newclient_udata));
 	if (!ud)
 		luaL_error (L, "can't alloc userdata");
-	
-	*udata = ud;
-	ud->hostname = malloc (namelen);
+
+	ud->hostname = malloc (namelen + 1);
 	if (!ud->hostname) {
 		free (ud);
-		luaL_error (L, "can't copy server name");
+		return luaL_error (L, "can't copy server name");
 	}
-	
-	memcpy (ud->hostname, hostname, namelen);
+
+	*udata = ud;
+	memcpy (ud->hostname, hostname, namelen + 1);
 	ud->remport = remport;
 	ud->localport = localport;
-	ud->err = 0;
-	
+	rx_wait_init (&ud->w, newclient_ready, 0);
+	rx_init (&ud->s, -1);
+
 	return 0;
 }
 
+/* name resolution still blocks the helper, the connection doesn't */
 static int newclient_work (void *udata) {
 	newclient_udata *ud = (newclient_udata *)udata;
-	
-	ud->new.remaddr.sin_family = AF_INET;
-	ud->new.remaddr.sin_port = ud->remport;
-	if ((ud->err = resolve (ud->hostname, &ud->new.remaddr.sin_addr)))
-		return 0;
-	
-	ud->new.fd = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
-	if (ud->new.fd < 0) {
-		ud->err = errno;
-		return 0;
-	}
-	
-	if (ud->localport) {
-		ud->new.myaddr.sin_family = AF_INET;
-		ud->new.myaddr.sin_port = ud->localport;
-		ud->new.myaddr.sin_addr.s_addr = INADDR_ANY;
-		
-		if (bind (ud->new.fd, (struct sockaddr *)&ud->new.myaddr, sizeof (ud->new.myaddr)) <0 ) {
-			close (ud->new.fd);
-			ud->err = errno;
+	struct sockaddr_in myaddr;
+	int fd;
+
+	if (ud->s.fd < 0) {
+		memset (&ud->remaddr, 0, sizeof (ud->remaddr));
+		ud->remaddr.sin_family = AF_INET;
+		ud->remaddr.sin_port = htons (ud->remport);
+		if (resolve (ud->hostname, &ud->remaddr.sin_addr)) {
+			ud->w.err = EHOSTUNREACH;
 			return 0;
 		}
+
+		fd = socket (PF_INET, SOCK_STREAM, IPPROTO_TCP);
+		if (fd < 0) {
+			ud->w.err = errno;
+			return 0;
+		}
+		if ((ud->w.err = set_nonblock (fd)) != 0) {
+			close (fd);
+			return 0;
+		}
+
+		if (ud->localport) {
+			memset (&myaddr, 0, sizeof (myaddr));
+			myaddr.sin_family = AF_INET;
+			myaddr.sin_port = htons (ud->localport);
+			myaddr.sin_addr.s_addr = INADDR_ANY;
+
+			if (bind (fd, (struct sockaddr *)&myaddr, sizeof (myaddr)) < 0) {
+				ud->w.err = errno;
+				close (fd);
+				return 0;
+			}
+		}
+		ud->s.fd = fd;
 	}
-	
-	if (connect (ud->new.fd, (struct sockaddr *)&ud->new.remaddr.sin_addr, sizeof (ud->new.remaddr)) < 0) {
-		close (ud->new.fd);
-		ud->err = errno;
-		return 0;
-	}
-	
+
+	rx_run (&ud->s, 1, &ud->w);
 	return 0;
 }
 
 static int newclient_finish (lua_State *L, void *udata) {
 	int r;
 	newclient_udata *ud = (newclient_udata *)udata;
-	
-	if (ud->err) {
-		lua_pushnil (L);
-		lua_pushstring (L, strerror (err));
-		if(ud->hostname)
-			free(ud->hostname);
-		free(ud);
+	struct sockaddr_in myaddr;
+	socklen_t addrlen = sizeof (myaddr);
 
+	rx_forget (&ud->s);
+	if (ud->w.err) {
+		if (ud->s.fd >= 0)
+			close (ud->s.fd);
+		lua_pushnil (L);
+		lua_pushstring (L, strerror (ud->w.err));
+		free (ud->hostname);
+		free (ud);
 		return 2;
 	}
-	
-	r = new_tcpstream (L, &ud->new);
+
+	getsockname (ud->s.fd, (struct sockaddr *)&myaddr, &addrlen);
+	r = new_tcpstream (L, ud->s.fd, &myaddr, &ud->remaddr);
 	free (ud->hostname);
 	free (ud);
 	return r;
@@ -317,64 +754,103 @@ static const task_ops newclient_ops = {
 };
 
 /***************************************
-  server:accept ()
+  server:accept ([n])
  ***************************************/
+typedef struct accepted {
+	int fd;
+	struct sockaddr_in remaddr;
+} accepted;
+
 typedef struct serv_accept_udata {
-	serverport_t sp;
-	tcpstream_t new;
-	int err;
+	rx_wait w;
+	serverport_t *sp;
+	int ref;
+	int many;					/* returns an array */
+	int max, n;
+	accepted *conn;
 } serv_accept_udata;
 
+/* takes as many pending connections as there are, up to max */
+static int serv_accept_ready (rx_wait *w) {
+	serv_accept_udata *ud = (serv_accept_udata *)w;
+
+	while (ud->n < ud->max) {
+		accepted *c = &ud->conn [ud->n];
+		socklen_t addrlen = sizeof (c->remaddr);
+#ifdef __linux__
+		c->fd = accept4 (ud->sp->s.fd, (struct sockaddr *)&c->remaddr, &addrlen, SOCK_NONBLOCK);
+#else
+		c->fd = accept (ud->sp->s.fd, (struct sockaddr *)&c->remaddr, &addrlen);
+		if (c->fd >= 0 && set_nonblock (c->fd) != 0) {
+			close (c->fd);
+			c->fd = -1;
+		}
+#endif
+		if (c->fd >= 0)
+			ud->n++;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return ud->n > 0;
+		else if (errno != EINTR && errno != ECONNABORTED) {
+			if (ud->n == 0)
+				w->err = errno;
+			return 1;
+		}
+	}
+	return 1;
+}
+
 static int serv_accept_prepare (lua_State *L, void **udata) {
 	serverport_t *sp = check_serverport (L, 1);
-	serv_accept_udata *ud = (serv_accept_udata *)malloc (sizeof (serv_accept_udata));
-	if (!ud) {
-		lua_pushnil (L);
-		lua_pushliteral (L, "can't alloc userdata");
-		return 2;
-	}
+	int many = lua_isnumber (L, 2);
+	int max = many ? lua_tointeger (L, 2) : 1;
+	serv_accept_udata *ud;
+
+	luaL_argcheck (L, max > 0, 2, "at least one connection");
+	ud = (serv_accept_udata *)malloc (sizeof (serv_accept_udata) + max * sizeof (accepted));
+	if (!ud)
+		luaL_error (L, "can't alloc userdata");
 	*udata = ud;
-	
-	ud->sp = *sp;
-	ud->err = 0;
-	memset (&ud->new, 0, sizeof (ud->new));
-	pipe_init (&ud->new.r, 0);
-	
+
+	/* the batch is retried on a helper, so several servers accept in parallel */
+	rx_wait_init (&ud->w, serv_accept_ready, 1);
+	ud->sp = sp;
+	ud->many = many;
+	ud->max = max;
+	ud->n = 0;
+	ud->conn = (accepted *)(ud + 1);
+	ud->ref = sock_pin (L, &sp->s);
+
 	return 0;
 }
 
 static int serv_accept_work (void *udata) {
 	serv_accept_udata *ud = (serv_accept_udata *)udata;
-	socklen_t addrlen = sizeof (ud->new.remaddr);
-	
-	ud->err = 0;
-	
-	if (listen (ud->sp.fd, 10) < 0 ) {
-		ud->err = errno;
-		return 0;
-	}
-	
-	ud->new.fd = accept (ud->sp.fd, (struct sockaddr *)&ud->new.remaddr, &addrlen);
-	if (ud->new.fd < 0) {
-		ud->err = errno;
-		return 0;
-	}
-	ud->new.myaddr = ud->sp.myaddr;
+
+	rx_run (&ud->sp->s, 0, &ud->w);
 	return 0;
 }
 
 static int serv_accept_finish (lua_State *L, void *udata) {
-	int r;
+	int i, r = 1;
 	serv_accept_udata *ud = (serv_accept_udata *)udata;
-	
-	if (ud->err) {
+
+	if (ud->w.err) {
 		lua_pushnil (L);
-		lua_pushstring (L, strerror (ud->err));
-		free (ud);
-		return 2;
+		lua_pushstring (L, strerror (ud->w.err));
+		r = 2;
+
+	} else if (!ud->many)
+		r = new_tcpstream (L, ud->conn [0].fd, &ud->sp->myaddr, &ud->conn [0].remaddr);
+
+	else {
+		lua_createtable (L, ud->n, 0);
+		for (i = 0; i < ud->n; i++) {
+			new_tcpstream (L, ud->conn [i].fd, &ud->sp->myaddr, &ud->conn [i].remaddr);
+			lua_rawseti (L, -2, i+1);
+		}
 	}
-	
-	r = new_tcpstream (L, &ud->new);
+
+	sock_unpin (L, &ud->sp->s, ud->ref);
 	free (ud);
 	return r;
 }
@@ -389,62 +865,76 @@ static const task_ops serv_accept_ops = {
  tcpstream:write (data)
  *****************************************/
 typedef struct tcpwrite_udata {
-	int fd;
+	rx_wait w;
+	tcpstream_t *str;
+	int ref;
 	pipe_t p;
-	int err;
 } tcpwrite_udata;
 
+static int tcpwrite_ready (rx_wait *w) {
+	tcpwrite_udata *ud = (tcpwrite_udata *)w;
+
+	while (pipe_dataleft (&ud->p)) {
+		ssize_t done = send (ud->str->s.fd, ud->p.head, pipe_dataleft (&ud->p), MSG_NOSIGNAL);
+		if (done >= 0)
+			ud->p.head += done;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		else if (errno != EINTR) {
+			w->err = errno;
+			return 1;
+		}
+	}
+
+	return 1;
+}
+
 static int tcpwrite_prepare (lua_State *L, void **udata) {
 	tcpstream_t *tcps = check_tcpstream (L, 1);
 	size_t datalen;
 	const char *data = luaL_checklstring (L, 2, &datalen);
-	
+
 	tcpwrite_udata *ud = (tcpwrite_udata *)malloc (sizeof (tcpwrite_udata));
-	if (!ud) 
+	if (!ud)
 		luaL_error (L, "can't alloc userdata");
-	
-	*udata = ud;
-	
-	ud->fd = tcps->fd;
-	ud->err = 0;
+
 	pipe_init (&ud->p, datalen);
-	if (!ud->p.data) {
+	if (datalen && !ud->p.data) {
 		free (ud);
-		luaL_error (L, "can't alloc buffer");
+		return luaL_error (L, "can't alloc buffer");
 	}
-	
+
+	*udata = ud;
 	pipe_push (&ud->p, data, datalen);
+
+	rx_wait_init (&ud->w, tcpwrite_ready, 0);
+	ud->str = tcps;
+	ud->ref = sock_pin (L, &tcps->s);
 	return 0;
 }
 
 static int tcpwrite_work (void *udata) {
 	tcpwrite_udata *ud = (tcpwrite_udata *)udata;
-	
-	while (pipe_dataleft (&ud->p)) {
-		size_t done = write (ud->fd, ud->p.head, pipe_dataleft (&ud->p));
-		if (done < 0) {
-			ud->err = errno;
-			return 0;
-		}
-		ud->p.head += done;
-	}
-	
+
+	rx_run (&ud->str->s, 1, &ud->w);
 	return 0;
 }
 
 static int tcpwrite_finish (lua_State *L, void *udata) {
 	tcpwrite_udata *ud = (tcpwrite_udata *)udata;
-	
-	if (ud->err) {
+	int r = 1;
+
+	if (ud->w.err) {
 		lua_pushnil (L);
-		lua_pushstring (L, strerror (ud->err));
-		pipe_free (&ud->p);
-		free (ud);
-		return 2;
-	}
-	
-	lua_pushboolean (L, 1);
-	return 1;
+		lua_pushstring (L, strerror (ud->w.err));
+		r = 2;
+	} else
+		lua_pushboolean (L, 1);
+
+	sock_unpin (L, &ud->str->s, ud->ref);
+	pipe_free (&ud->p);
+	free (ud);
+	return r;
 }
 
 static const task_ops tcpwrite_ops = {
@@ -457,42 +947,103 @@ static const task_ops tcpwrite_ops = {
   tcpstream:read ([format])
  *******************************/
 typedef struct tcpread_udata {
+	rx_wait w;
 	tcpstream_t *str;
+	int ref;
 	enum {
 		RK_NULL,
 		RK_LINE,
 		RK_ATMOST
 	} kind;
-	int size;
-	int err;
+	size_t size;
 } tcpread_udata;
 
+/* enough data buffered?  for a line, size is its length */
+static int tcpread_try_inline (void *udata) {
+	tcpread_udata *ud = (tcpread_udata *)udata;
+	pipe_t *p = &ud->str->r;
+	char *cp;
+
+	switch (ud->kind) {
+		case RK_LINE:
+			cp = p->head ? memchr (p->head, '\n', pipe_dataleft (p)) : NULL;
+			if (cp) {
+				ud->size = cp - p->head;
+				return 1;
+			}
+			break;
+
+		case RK_ATMOST:
+			return pipe_dataleft (p) >= ud->size;
+
+		default:
+			break;
+	}
+	return 0;
+}
+
+static int tcpread_ready (rx_wait *w) {
+	tcpread_udata *ud = (tcpread_udata *)w;
+	tcpstream_t *tcps = ud->str;
+	pipe_t *p = &tcps->r;
+
+	if (ud->kind == RK_NULL)
+		return 1;
+
+	while (!tcpread_try_inline (ud) && !tcps->eof) {
+		ssize_t r;
+		size_t want = TCP_RBUFSIZE;
+
+		if (ud->kind == RK_ATMOST)
+			want = MAX (want, ud->size - pipe_dataleft (p));
+		if (pipe_spaceleft (p) < want)
+			pipe_makespace (p, want);
+		if (pipe_spaceleft (p) == 0) {
+			w->err = ENOMEM;
+			return 1;
+		}
+
+		r = recv (tcps->s.fd, p->tail, pipe_spaceleft (p), 0);
+		if (r > 0)
+			p->tail += r;
+		else if (r == 0)
+			tcps->eof = 1;
+		else if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return 0;
+		else if (errno != EINTR) {
+			w->err = errno;
+			return 1;
+		}
+	}
+	return 1;
+}
+
 static int tcpread_prepare (lua_State *L, void **udata) {
-	int n;
+	lua_Number n;
 	tcpstream_t *tcps = check_tcpstream (L, 1);
 	tcpread_udata *ud = (tcpread_udata *)malloc (sizeof (tcpread_udata));
-	if (!ud) 
+	if (!ud)
 		luaL_error (L, "can't alloc userdata");
 	*udata = ud;
-	
+
+	rx_wait_init (&ud->w, tcpread_ready, 0);
 	ud->str = tcps;
 	ud->kind = RK_NULL;
 	ud->size = 0;
-	ud->err = 0;
-	
-	if (lua_isnoneornil (L, 2))
+
+	if (lua_isnoneornil (L, 2) || lua_islightuserdata (L, 2))
 		ud->kind = RK_LINE;
-	
+
 	else {
 		n = lua_tonumber (L, 2);
-		
-		if (n) {
-			ud->size = n;
+
+		if (n > 0) {
+			ud->size = (size_t)n;
 			ud->kind = RK_ATMOST;
-			
+
 		} else {
 			const char *str = lua_tostring (L, 2);
-			if (str[0] == '*') {
+			if (str && str[0] == '*') {
 				switch (str[1]) {
 					case 'l':
 						ud->kind = RK_LINE;
@@ -501,116 +1052,76 @@ static int tcpread_prepare (lua_State *L, void **udata) {
 			}
 		}
 	}
+	ud->ref = sock_pin (L, &tcps->s);
 	return 0;
 }
 
 static int tcpread_work (void *udata) {
 	tcpread_udata *ud = (tcpread_udata *)udata;
-	pipe_t *p = &ud->str->r;
-	size_t toread;
-	
-	switch (ud->kind) {
-		case RK_NULL:
-			return 0;
-			break;
-			
-		case RK_LINE:
-			{
-				char *cp;
-				ssize_t r = 0;
-				
-				while (1) {
-					if (pipe_spaceleft (p) ==0)
-						pipe_makespace (p, 1024);
-					cp = p->head;
-				
-					while (*cp != '\r' && *cp != '\n' && cp < p->tail)
-						cp++;
-					if (cp < p->tail) {
-						ud->size = cp-p->head;
-						return 0;
-					}
-					
-					r = read (ud->str->fd, p->tail, pipe_spaceleft (p));
-					if (r <= 0) {
-						ud->err = errno;
-						return 0;
-					}
-					p->tail += r;
-				}
-			}
-			break;
-			
-		case RK_ATMOST:
-			toread = ud->size - pipe_dataleft (p);
-			pipe_makespace (p, toread);
-			if (pipe_spaceleft (p) < toread) {
-				ud->err = ENOMEM;
-				return 0;
-			}
-			while (toread > 0) {
-				ssize_t r = read (ud->str->fd, p->tail, toread);
-				if (r < 0) {
-					ud->err = errno;
-					return 0;
-				}
-				p->tail += r;
-				toread -= r;
-			}
-			break;
-	}
+
+	rx_run (&ud->str->s, 0, &ud->w);
 	return 0;
 }
 
 static int tcpread_finish (lua_State *L, void *udata) {
 	tcpread_udata *ud = (tcpread_udata *)udata;
 	pipe_t *p = &ud->str->r;
-	
-	if (ud->err) {
-		lua_pushnil (L);
-		lua_pushstring (L, strerror (ud->err));
-		free (ud);
-		return 2;
-	}
-	
-	if (pipe_dataleft (p) <= 0) {
+	size_t len = pipe_dataleft (p);
+	int r = 1;
+
+	if (ud->w.err) {
 		lua_pushnil (L);
-		lua_pushliteral (L, "closed");
-		return 2;
-	}
-	
-	switch (ud->kind) {
+		lua_pushstring (L, strerror (ud->w.err));
+		r = 2;
+
+	} else switch (ud->kind) {
 		case RK_NULL:
 			lua_pushnil (L);
 			break;
-			
+
 		case RK_LINE:
-			lua_pushlstring (L, p->head, ud->size);
-			p->head += ud->size;
-			if (*p->head == '\n' && p->head < p->tail)
-				p->head++;
-			else {
-				if (*p->head == '\r' && p->head < p->tail)
-					p->head++;
-				if (*p->head == '\n' && p->head < p->tail)
-					p->head++;
+			if (tcpread_try_inline (ud)) {
+				len = ud->size;
+				if (len > 0 && p->head [len-1] == '\r')
+					len--;
+				lua_pushlstring (L, p->head, len);
+				p->head += ud->size + 1;
+				break;
 			}
+			/* at the end of the stream, the last line may lack its newline */
+			if (len > 0) {
+				lua_pushlstring (L, p->head, len);
+				p->head = p->tail;
+				break;
+			}
+			lua_pushnil (L);
+			lua_pushliteral (L, "closed");
+			r = 2;
 			break;
-			
+
 		case RK_ATMOST:
-			lua_pushlstring (L, p->head, pipe_dataleft (p));
-			p->head = p->tail;
+			if (len == 0) {
+				lua_pushnil (L);
+				lua_pushliteral (L, "closed");
+				r = 2;
+				break;
+			}
+			len = MIN (len, ud->size);
+			lua_pushlstring (L, p->head, len);
+			p->head += len;
 			break;
 	}
-	
+
+	sock_unpin (L, &ud->str->s, ud->ref);
 	free (ud);
-	return 1;
+	return r;
 }
 
 static const task_ops tcpread_ops = {
 	tcpread_prepare,
 	tcpread_work,
-	tcpread_finish
+	tcpread_finish,
+	tcpread_try_inline
 };
 
 /**********************************
@@ -618,13 +1129,11 @@ static const task_ops tcpread_ops = {
  **********************************/
 static int tcpclose (lua_State *L) {
 	tcpstream_t *tcps = check_tcpstream (L, 1);
-	
-	if (tcps->fd) {
-		close (tcps->fd);
-		tcps->fd = 0;
-	}
-	pipe_free (&tcps->r);
-	
+
+	sock_close (&tcps->s);
+	if (tcps->s.pending == 0)
+		pipe_free (&tcps->r);
+
 	return 0;
 }
 
@@ -633,11 +1142,8 @@ static int tcpclose (lua_State *L) {
  ***********************************/
 static int serverclose (lua_State *L) {
 	serverport_t *sp = check_serverport (L, 1);
-	if (sp->fd) {
-		close (sp->fd);
-		sp->fd = 0;
-	}
-	
+
+	sock_close (&sp->s);
 	return 0;
 }
 
@@ -673,6 +1179,7 @@ static const task_reg server_tasks [] = {
 /* nb_tcp library functions and tasks */
 static const struct luaL_reg nb_tcp_funcs [] = {
 	{"newserver", newserver},
+	{"newservers", newservers},
 	{NULL, NULL}
 };
 
@@ -684,23 +1191,32 @@ static const task_reg nb_tcp_tasks [] = {
 int luaopen_nb_tcp (lua_State *L);
 int luaopen_nb_tcp (lua_State *L) {
 	helper_init (L);
-	
+
+#ifdef __linux__
+	lua_newuserdata (L, 1);
+	lua_newtable (L);
+	lua_pushcfunction (L, rx_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_setmetatable (L, -2);
+	luaL_ref (L, LUA_REGISTRYINDEX);
+#endif
+
 	luaL_newmetatable(L, TCPStreamType);
 	lua_pushliteral(L, "__index");
 	lua_pushvalue(L, -2);
 	lua_rawset(L, -3);
 	luaL_openlib (L, NULL, tcp_meths, 0);
 	tasklib (L, NULL, tcp_tasks);
-	
+
 	luaL_newmetatable(L, ServerPortType);
 	lua_pushliteral(L, "__index");
 	lua_pushvalue(L, -2);
 	lua_rawset(L, -3);
 	luaL_openlib (L, NULL, server_meths, 0);
 	tasklib (L, NULL, server_tasks);
-	
+
 	luaL_openlib (L, "nb_tcp", nb_tcp_funcs, 0);
 	tasklib (L, NULL, nb_tcp_tasks);
-	
+
 	return 1;
 }
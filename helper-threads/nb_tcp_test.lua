@@ -14,13 +14,12 @@ local function handle_client (conn)
 end
 
 local function do_listen ()
-	sched.add_helpers ("listeners", 4)
 	local srv = assert (nb_tcp.newserver (8080))
 	while true do
 		local conn = assert (sched.yield (srv:accept ()))
 		sched.add_thread (function ()
 			handle_client (conn)
-		end, "listeners")
+		end)
 	end
 end
 
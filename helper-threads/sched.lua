@@ -4,40 +4,18 @@
  * $Id: sched.lua,v 1.14 2007-07-31 23:53:34 jguerra Exp $
 --]]
 
-local assert, error, next, unpack = assert, error, next, unpack
-local coroutine, table = coroutine, table
+local assert, error, next, pairs, unpack = assert, error, next, pairs, unpack
+local setmetatable, getmetatable, ipairs, type = setmetatable, getmetatable, ipairs, type
+local coroutine, table, math = coroutine, table, math
 local helper = require "helper"
 
 module (arg and arg[1])
 
 local _out_queue = helper.newqueue ()
-local _task_co = {}
-local _co_queue = {}
-local _co_thread = {}
+local _disp = helper.newdispatcher (_out_queue)
 local _name_queue = {}
 local _name_threads = {}
-
----------------------
--- resumes a coroutine
--- is run until blocked again, the new
--- blocking task is added to the queue
----------------------
-local function _step (co, task)
-	
-	local ok, task2 = coroutine.resume (co, task)
-	if not ok then error (task2) end
-	
-	if task2 and coroutine.status (co) ~= "dead" then
-		_task_co [task2] = co
-		if helper.state (task2) == "Ready" then
-			_co_queue [co]:addtask (task2)
-		end
-		
-	else
-		_co_thread [co] = nil
-		_co_queue [co] = nil
-	end
-end
+local _name_flows = {}
 
 
 --------------------------------------------------------
@@ -56,35 +34,85 @@ function add_helpers (name, n_helpers)
 	for i = 1, n_helpers do
 		table.insert (thrdlist, helper.newthread (queue, _out_queue))
 	end
+	_name_flows [name] = _name_flows [name] or {}
+	_disp:fairqueue (queue, #thrdlist)
+end
+
+local function getflow (name, group, weight)
+	local flows = assert (_name_flows [name], "unknown queue name")
+	local flow = flows [group]
+	if not flow then
+		flow = _disp:newflow (_name_queue [name], weight)
+		flows [group] = flow
+	end
+	return flow
 end
 
 ---------------------------------------------------------------------------
--- sched.add_thread (f [, name])
+-- sched.set_weight (name, group, weight)
+--
+-- sets the share of the named queue given to the threads of group
+-- (default 1); a group with weight 2 gets twice the tasks of one
+-- with weight 1 in each round, when they all have tasks waiting
+---------------------------------------------------------------------------
+function set_weight (name, group, weight)
+	getflow (name, group, weight):weight (weight)
+end
+
+local _MAXIDLE = 256
+local _idle = {}
+local _job = {}
+
+-- runs the functions given by add_thread() one after another,
+-- waiting in _idle between them.  yielding nothing tells the
+-- dispatcher it's finished
+local function trampoline ()
+	local co = coroutine.running ()
+	repeat
+		local f = _job [co]
+		_job [co] = nil
+		f ()
+		if #_idle >= _MAXIDLE then
+			return
+		end
+		_idle [#_idle+1] = co
+		coroutine.yield ()
+	until false
+end
+
+---------------------------------------------------------------------------
+-- sched.add_thread (f [, name [, group]])
 --
 -- f: function; wrapped in a coroutine and scheduled to run
 -- name: any;  all threads with the same name use the same helper thread
---     if nil, false or omitted, it gets it's own helper thread
+--     if true, nil or omitted, each task goes to the shared pool of its class
+--     if false, it gets it's own helper thread
+-- group: any; the named queue is shared fairly between groups
+--     (see set_weight()); by default each thread is its own group
 ---------------------------------------------------------------------------
-function add_thread (f, name)
+function add_thread (f, name, group)
 	
 	local queue, thread
 	
-	if name then
+	if name == nil or name == true then
+		queue = true
+		thread = nil
+	elseif name then
 		assert (_name_queue [name], "unknown queue name")
-		queue = _name_queue [name]
+		if group == nil then
+			queue = _disp:newflow (_name_queue [name])
+		else
+			queue = getflow (name, group)
+		end
 		thread = nil
 	else
 		queue = helper.newqueue ()
 		thread = helper.newthread (queue, _out_queue)
 	end
-	local co = coroutine.create (function (t) helper.update (t) return f() end)
 	
-	local task = helper.null ()
-	queue:addtask (task)
-	
-	_task_co [task] = co
-	_co_queue [co] = queue
-	_co_thread [co] = thread
+	local co = table.remove (_idle) or coroutine.create (trampoline)
+	_job [co] = f
+	_disp:spawn (co, nil, queue, thread)
 end
 
 ------------------------------------------------------
@@ -98,6 +126,23 @@ function yield (t, ...)
 	return helper.update (coroutine.yield (t), ...)
 end
 
+------------------------------------------------------
+-- sched.yield_timeout (task, timeout [, ...])
+--
+-- like sched.yield(), but gives up after timeout seconds,
+-- returning nil, "timeout".  the task is cancelled if its
+-- type can be, else it's left to finish on its own; any
+-- result is discarded.  tasks that signal can only get a
+-- timeout if they can be cancelled
+---------------------------------------------------------
+function yield_timeout (t, timeout, ...)
+	local tk = coroutine.yield (t, timeout)
+	if tk == nil then
+		return nil, "timeout"
+	end
+	return helper.update (tk, ...)
+end
+
 --------------------------------------
 -- helper.run ()
 --
@@ -105,51 +150,504 @@ end
 -- finishes when all threads are done
 --------------------------------------
 function run ()
-	while next (_task_co) ~= nil do
-		local task = _out_queue:wait()
-		if task ~= nil then
-			local co = _task_co [task]
+	_disp:run ()
+end
+
+--------------------------------------------------------
+-- channels
+--
+-- handled by the dispatcher: a coroutine that has to wait
+-- yields false and is woken by the other end
+--------------------------------------------------------
+local Channel = {}
+Channel.__index = Channel
+
+local function current ()
+	local h = _disp:current ()
+	if not h then
+		error ("channels can only block inside sched threads", 3)
+	end
+	return h
+end
+
+local function park ()
+	coroutine.yield (false)
+end
+
+-- first waiter not already served by a select()
+local function popwaiter (list)
+	while list [1] do
+		local e = table.remove (list, 1)
+		if not e.w.fired then
+			return e
+		end
+	end
+end
+
+local function fire (e, ok, v)
+	local w = e.w
+	w.fired, w.ok, w.i, w.value = true, ok, e.i, v
+	_disp:wake (w.h)
+end
+
+local function bufpush (ch, v)
+	ch.last = ch.last +1
+	ch.buf [ch.last] = v
+end
+
+local function bufpop (ch)
+	local v = ch.buf [ch.first]
+	ch.buf [ch.first] = nil
+	ch.first = ch.first +1
+	return v
+end
+
+local function buflen (ch)
+	return ch.last - ch.first +1
+end
+
+-- tries to send without blocking. true if done, or nil, "closed"
+local function trysend (ch, v)
+	if ch.closed then
+		return nil, "closed"
+	end
+	local r = popwaiter (ch.receivers)
+	if r then
+		fire (r, true, v)
+		return true
+	end
+	if buflen (ch) < ch.cap then
+		bufpush (ch, v)
+		return true
+	end
+	return false
+end
+
+-- tries to receive without blocking. true and the value if done,
+-- nil, "closed" if closed and empty, or false
+local function tryrecv (ch)
+	if buflen (ch) > 0 then
+		local v = bufpop (ch)
+		local s = popwaiter (ch.senders)
+		if s then
+			bufpush (ch, s.value)
+			fire (s, true)
+		end
+		return true, v
+	end
+	local s = popwaiter (ch.senders)
+	if s then
+		fire (s, true)
+		return true, s.value
+	end
+	if ch.closed then
+		return nil, "closed"
+	end
+	return false
+end
+
+---------------------------------------------------------------------------
+-- sched.channel ([capacity])
+--
+-- a channel between sched threads, holding up to capacity values
+-- (default 0: each send() waits for a recv())
+---------------------------------------------------------------------------
+function channel (cap)
+	return setmetatable ({
+		cap = cap or 0,
+		buf = {}, first = 1, last = 0,
+		senders = {}, receivers = {},
+		closed = false,
+	}, Channel)
+end
+
+---------------------------------------------------------------------------
+-- channel:send (v)
+--
+-- sends a non-nil value, waiting for room if needed.
+-- returns true, or nil, "closed"
+---------------------------------------------------------------------------
+function Channel:send (v)
+	if v == nil then
+		error ("can't send nil", 2)
+	end
+	local ok, err = trysend (self, v)
+	if ok ~= false then
+		return ok, err
+	end
+	local e = {value = v, w = {h = current ()}}
+	self.senders [#self.senders+1] = e
+	park ()
+	if not e.w.ok then
+		return nil, "closed"
+	end
+	return true
+end
+
+---------------------------------------------------------------------------
+-- channel:recv ()
+--
+-- returns the next value, waiting for one if needed.
+-- nil, "closed" once it's closed and empty
+---------------------------------------------------------------------------
+function Channel:recv ()
+	local ok, v = tryrecv (self)
+	if ok then
+		return v
+	elseif ok == nil then
+		return nil, v
+	end
+	local e = {w = {h = current ()}}
+	self.receivers [#self.receivers+1] = e
+	park ()
+	if not e.w.ok then
+		return nil, "closed"
+	end
+	return e.w.value
+end
+
+---------------------------------------------------------------------------
+-- channel:close ()
+--
+-- no more values can be sent; the waiting threads get nil, "closed"
+-- (receivers only once the buffer is empty)
+---------------------------------------------------------------------------
+function Channel:close ()
+	self.closed = true
+	for _, list in pairs {self.receivers, self.senders} do
+		local e = popwaiter (list)
+		while e do
+			fire (e, false)
+			e = popwaiter (list)
+		end
+	end
+end
+
+---------------------------------------------------------------------------
+-- sched.select (ops [, nowait])
+--
+-- waits until one of the operations can be done, and does it.
+-- each op is a channel to receive from, or {channel, value} to send.
+-- returns the index of the op done, and the value received
+-- (or nil, "closed" as the second and third values if its
+-- channel was closed). with nowait, returns nil if none is ready
+---------------------------------------------------------------------------
+function select (ops, nowait)
+	for i, op in ipairs (ops) do
+		if getmetatable (op) == Channel then
+			local ok, v = tryrecv (op)
+			if ok then
+				return i, v
+			elseif ok == nil then
+				return i, nil, v
+			end
+		else
+			local ok, err = trysend (op [1], op [2])
+			if ok ~= false then
+				return i, ok, err
+			end
+		end
+	end
+	if nowait then
+		return nil
+	end
+	
+	local w = {h = current ()}
+	for i, op in ipairs (ops) do
+		if getmetatable (op) == Channel then
+			op.receivers [#op.receivers+1] = {w = w, i = i}
+		else
+			op [1].senders [#op [1].senders+1] = {w = w, i = i, value = op [2]}
+		end
+	end
+	park ()
+	
+	-- take our entries out of the other channels
+	for _, op in ipairs (ops) do
+		local ch = getmetatable (op) == Channel and op or op [1]
+		for _, list in pairs {ch.receivers, ch.senders} do
+			for j = #list, 1, -1 do
+				if list [j].w == w then
+					table.remove (list, j)
+				end
+			end
+		end
+	end
+	
+	if getmetatable (ops [w.i]) == Channel then
+		if w.ok then
+			return w.i, w.value
+		end
+		return w.i, nil, "closed"
+	end
+	if w.ok then
+		return w.i, true
+	end
+	return w.i, nil, "closed"
+end
+
+--------------------------------------------------------
+-- pipelines
+--------------------------------------------------------
+local Pipeline = {}
+Pipeline.__index = Pipeline
+
+-- a stage whose input is backed up while its output isn't
+-- is the slowest one: it gets another worker
+local function addworker (st)
+	st.workers = st.workers +1
+	st.active = st.active +1
+	add_thread (function ()
+		while true do
+			local v = st.input:recv ()
+			if v == nil then break end
 			
-			if helper.state (task) == "Done" then
-				_task_co [task] = nil
+			local t0 = helper.now ()
+			v = st.f (v)
+			st.busy = st.busy + helper.now () - t0
+			st.items = st.items +1
+			if v ~= nil then
+				st.output:send (v)
 			end
-		
-			_step (co, task)
+			
+			if st.workers < st.max and #st.input.senders > 0
+					and buflen (st.output) < st.output.cap then
+				addworker (st)
+			end
+		end
+		st.active = st.active -1
+		if st.active == 0 then
+			st.output:close ()
+		end
+	end, st.queue)
+end
+
+---------------------------------------------------------------------------
+-- sched.pipeline {stage1, stage2, ... [, buffer = n] [, max = n]}
+--
+-- chains the stages with bounded channels.  each stage is a function
+-- f (v) or a table {f = function, workers = n, max = n, buffer = n,
+-- queue = name, name = any}.  f runs in 'workers' sched threads
+-- (default 1, using the named queue if given), and returns the value
+-- for the next stage (nil drops it).  a stage that can't keep up gets
+-- more workers, up to max (default 16).  buffer is the capacity of the
+-- channel after the stage (default 16)
+---------------------------------------------------------------------------
+function pipeline (stages)
+	local p = setmetatable ({stages = {}, start = helper.now ()}, Pipeline)
+	local buffer = stages.buffer or 16
+	local input = channel (buffer)
+	
+	p.input = input
+	for i, spec in ipairs (stages) do
+		if type (spec) == "function" then
+			spec = {f = spec}
+		end
+		local st = {
+			name = spec.name or i,
+			f = spec.f,
+			queue = spec.queue,
+			max = spec.max or stages.max or 16,
+			input = input,
+			output = channel (spec.buffer or buffer),
+			workers = 0, active = 0,
+			items = 0, busy = 0,
+		}
+		p.stages [i] = st
+		for j = 1, spec.workers or 1 do
+			addworker (st)
 		end
+		input = st.output
 	end
+	p.output = input
+	return p
 end
 
-function par_foreach (in_t, f_a, f_b, n_th)
-	local out_t = {}
-	local in_q = helper.newqueue ()
+-- pipeline:send (v), feeds the first stage
+function Pipeline:send (v)
+	return self.input:send (v)
+end
+
+-- pipeline:close (), no more input; the stages finish what's buffered
+function Pipeline:close ()
+	return self.input:close ()
+end
+
+-- pipeline:recv (), next result of the last stage
+function Pipeline:recv ()
+	return self.output:recv ()
+end
+
+---------------------------------------------------------------------------
+-- pipeline:stats ()
+--
+-- returns an array with a table for each stage: name, workers,
+-- items done, rate (items per second), latency (average secs per
+-- item) and buffered (items waiting at its input)
+---------------------------------------------------------------------------
+function Pipeline:stats ()
+	local elapsed = math.max (helper.now () - self.start, 1e-6)
+	local out = {}
+	for i, st in ipairs (self.stages) do
+		out [i] = {
+			name = st.name,
+			workers = st.workers,
+			items = st.items,
+			rate = st.items / elapsed,
+			latency = st.items > 0 and st.busy / st.items or 0,
+			buffered = buflen (st.input),
+		}
+	end
+	return out
+end
+
+local _MAXWINDOW = 1024
+
+local function default_b (t)
+	return helper.update (t)
+end
+
+---------------------------------------------------------------------------
+-- sched.par_map (in_t, f_a [, f_b [, opts]])
+--
+-- f_a (k, v) returns a one-shot task for each item of in_t,
+-- run in the shared pools (if it signals, the signals are updated
+-- and dropped).  f_b (task, k) turns the finished task into the
+-- result (default helper.update()).  in_t isn't modified.
+-- opts:
+--   batch: number of items done by each trip to a helper (default 1)
+--   window: max batches in flight (default: adapted to the measured
+--       throughput and latency)
+--   ordered: in_t is taken as an array, results are delivered by index
+--   each: function (k, result) called for each result as delivered;
+--       if given, no result table is returned
+---------------------------------------------------------------------------
+function par_map (in_t, f_a, f_b, opts)
+	opts = opts or {}
+	f_b = f_b or default_b
+	local nbatch = opts.batch or 1
+	local ordered = opts.ordered
+	local out_t = not opts.each and {} or nil
+	local deliver = opts.each or function (k, v) out_t [k] = v end
+	
+	local keys = {}
+	if ordered then
+		for i = 1, #in_t do keys [i] = i end
+	else
+		for k in pairs (in_t) do keys [#keys+1] = k end
+	end
+	
 	local out_q = helper.newqueue ()
 	local on_q = {}
 	local on_q_n = 0
-	local threads = {}
+	local nextk = 1
+	local held, has, nextout = {}, {}, 1
 	
-	for i = 1, n_th do
-		threads[#threads + 1] =helper.newthread (in_q, out_q)
-	end
-	
-	while next (in_t, nil) ~= nil or on_q_n > 0 do
+	local limit = opts.window or 2
+	local minlat
+	local epoch, epoch_n, epoch_lat = helper.now (), 0, 0
 	
-		while on_q_n < n_th*2 and next (in_t, nil) ~= nil do
-			local k = next (in_t, nil)
-			local tsk = f_a (k, in_t [k])
-			in_q:addtask (tsk)
-			on_q [tsk] = k
+	while nextk <= #keys or on_q_n > 0 do
+		
+		while on_q_n < limit and nextk <= #keys do
+			local first, last = nextk, math.min (nextk + nbatch - 1, #keys)
+			local tsk
+			if first == last then
+				tsk = f_a (keys [first], in_t [keys [first]])
+			else
+				local subs = {}
+				for i = first, last do
+					subs [#subs+1] = f_a (keys [i], in_t [keys [i]])
+				end
+				tsk = helper.batch (subs)
+			end
+			helper.dispatch (tsk, out_q)
+			on_q [tsk] = {first, last, helper.now ()}
 			on_q_n = on_q_n +1
-			in_t [k] = nil
+			nextk = last +1
 		end
 		
 		local tsk = out_q:wait ()
-		local k = tsk and on_q [tsk]
-		if k then
-			out_t [k] = f_b (tsk, k)
+		local rec = tsk and on_q [tsk]
+		if rec and helper.state (tsk) ~= "Done" then
+			helper.update (tsk)			-- signalled, it comes back when it's done
+		elseif rec then
 			on_q [tsk] = nil
 			on_q_n = on_q_n -1
+			
+			local first, last, sent = rec[1], rec[2], rec[3]
+			local subs = first == last and {tsk} or helper.update (tsk)
+			for i = first, last do
+				local v = f_b (subs [i-first+1], keys [i])
+				if ordered then
+					held [i], has [i] = v, true
+				else
+					deliver (keys [i], v)
+				end
+			end
+			while has [nextout] do
+				deliver (nextout, held [nextout])
+				held [nextout], has [nextout] = nil, nil
+				nextout = nextout +1
+			end
+			
+			-- keep about twice the batches that fit in the lowest
+			-- average latency seen, at the current throughput
+			local now = helper.now ()
+			epoch_n, epoch_lat = epoch_n +1, epoch_lat + (now - sent)
+			if not opts.window and epoch_n >= limit then
+				local lat = epoch_lat / epoch_n
+				if not minlat or lat < minlat then minlat = lat end
+				local rate = epoch_n / math.max (now - epoch, 1e-6)
+				limit = math.max (2, math.min (_MAXWINDOW, math.ceil (2 * rate * minlat)))
+				epoch, epoch_n, epoch_lat = now, 0, 0
+			end
 		end
 	end
 	
 	return out_t
 end
+
+---------------------------------------------------------------------------
+-- sched.par_reduce (in_t, f_a, f_b, combine [, opts])
+--
+-- like par_map(), but the results are folded with combine (a, b)
+-- as they arrive, pairing them as a balanced binary tree.  with
+-- opts.ordered, combine only has to be associative.
+-- returns the combined value, nil if in_t is empty
+---------------------------------------------------------------------------
+function par_reduce (in_t, f_a, f_b, combine, opts)
+	local slots, n = {}, 0
+	local o = {}
+	for k, v in pairs (opts or {}) do o [k] = v end
+	
+	o.each = function (k, v)
+		if v == nil then return end
+		local l = 1
+		while l <= n and slots [l] ~= nil do
+			v = combine (slots [l], v)
+			slots [l] = nil
+			l = l +1
+		end
+		slots [l] = v
+		if l > n then n = l end
+	end
+	par_map (in_t, f_a, f_b, o)
+	
+	local acc
+	for l = 1, n do
+		if slots [l] ~= nil then
+			if acc == nil then acc = slots [l] else acc = combine (slots [l], acc) end
+		end
+	end
+	return acc
+end
+
+---------------------------------------------------------------------------
+-- sched.par_foreach (in_t, f_a, f_b [, n_th])
+--
+-- older form of par_map(), n_th limits the work in flight
+---------------------------------------------------------------------------
+function par_foreach (in_t, f_a, f_b, n_th)
+	return par_map (in_t, f_a, f_b, {window = n_th and n_th*2})
+end
@@ -3,6 +3,153 @@ require "helper"
 require "sched"
 require "timer"
 
+-- quick behaviour checks, before the (endless) demo
+
+-- the dispatcher resumes each thread when its task is done
+local order = {}
+sched.add_thread (function ()
+	sched.yield (timer.timer (0.06))
+	order [#order+1] = "slow"
+end)
+sched.add_thread (function ()
+	sched.yield (timer.timer (0.01))
+	order [#order+1] = "fast"
+end)
+sched.run ()
+assert (order [1] == "fast" and order [2] == "slow")
+print ("dispatcher: ok")
+
+-- deadlines: a late task is dropped, one in time isn't
+sched.add_thread (function ()
+	local t0 = helper.now ()
+	local r, err = sched.yield_timeout (timer.timer (1), 0.05)
+	assert (r == nil and err == "timeout" and helper.now () - t0 < 0.5)
+	t0 = helper.now ()
+	r, err = sched.yield_timeout (timer.timer (0.01), 1)
+	assert (err == nil and helper.now () - t0 < 0.5)
+end)
+sched.run ()
+print ("deadlines: ok")
+
+-- cancelled ticks end instead of coming back forever
+sched.add_thread (function ()
+	local r, err = sched.yield_timeout (timer.ticks (0.5), 0.01)
+	assert (r == nil and err == "timeout")
+end)
+sched.run ()
+print ("cancelled ticks: ok")
+
+-- finished threads' coroutines are reused
+local cos = {}
+for i = 1, 2 do
+	sched.add_thread (function () cos [i] = coroutine.running () end)
+	sched.run ()
+end
+assert (cos [1] and cos [1] == cos [2])
+print ("recycled coroutines: ok")
+
+-- fair flows: with both groups backed up, weight 2 gets twice the turns
+sched.add_helpers ("fair", 1)
+sched.set_weight ("fair", "b", 2)
+local done = {}
+for i = 1, 4 do
+	for _, g in ipairs {"a", "b"} do
+		sched.add_thread (function ()
+			for j = 1, 10 do
+				sched.yield (timer.timer (0.001))
+				done [#done+1] = g
+			end
+		end, "fair", g)
+	end
+end
+sched.run ()
+local got = {a = 0, b = 0}
+for i = 1, 30 do got [done [i]] = got [done [i]] +1 end
+print ("fair flows:", got.a, got.b)
+assert (#done == 80 and got.b >= 1.5 * got.a)
+
+-- channels and select
+local ch, quit = sched.channel (), sched.channel (2)
+local recvd = {}
+sched.add_thread (function ()
+	for i = 1, 5 do assert (ch:send (i)) end
+	quit:send ("bye")
+	ch:close ()
+end)
+sched.add_thread (function ()
+	while true do
+		local i, v, err = sched.select {ch, quit}
+		if err == "closed" then break end
+		recvd [#recvd+1] = v
+	end
+end)
+sched.run ()
+assert (#recvd == 6 and recvd [1] == 1 and recvd [5] == 5 and recvd [6] == "bye")
+assert (ch:send (1) == nil and sched.select ({quit}, true) == nil)
+print ("channels and select: ok")
+
+-- a handle outlives its coroutine, waking it is refused
+local d = helper.newdispatcher (helper.newqueue ())
+local h1, h2
+d:spawn (coroutine.create (function () h1 = d:current () end), nil, true)
+d:run ()
+d:spawn (coroutine.create (function () h2 = d:current () coroutine.yield (false) end), nil, true)
+d:run ()
+assert (h1 ~= h2 and not pcall (d.wake, d, h1))
+d:wake (h2)
+d:run ()
+print ("stale handles: ok")
+
+-- pipeline: stages in order, closing flows through
+local p = sched.pipeline {
+	function (v) return v * 2 end,
+	{f = function (v) return v + 1 end, workers = 2},
+}
+local sum = 0
+sched.add_thread (function ()
+	for i = 1, 50 do p:send (i) end
+	p:close ()
+end)
+sched.add_thread (function ()
+	local v = p:recv ()
+	while v do
+		sum = sum + v
+		v = p:recv ()
+	end
+end)
+sched.run ()
+assert (sum == 50 * 51 + 50 and p:stats () [1].items == 50)
+print ("pipeline: ok")
+
+-- par_map keeps the order when asked, par_reduce folds everything
+local in_t = {}
+for i = 1, 20 do in_t [i] = (i % 3) / 200 end
+local function delay (k, v) return timer.timer (v) end
+local seen = {}
+sched.par_map (in_t, delay, function (t, k) helper.update (t) return k * 2 end, {
+	batch = 3, ordered = true,
+	each = function (k, v) assert (v == k * 2) seen [#seen+1] = k end,
+})
+for i = 1, 20 do assert (seen [i] == i) end
+local total = sched.par_reduce (in_t, delay, function (t, k) helper.update (t) return k end,
+	function (a, b) return a + b end)
+assert (total == 210)
+print ("par_map and par_reduce: ok")
+
+-- ticks count the periods missed between updates
+local q = helper.newqueue ()
+local tk = timer.ticks (0.05)
+helper.dispatch (tk, q)
+assert (q:wait () == tk)
+helper.update (timer.timer (0.18))			-- still 'Ready', so it just sleeps here
+local missed = helper.update (tk)
+print ("ticks missed:", missed)
+assert (missed >= 2 and missed <= 4)
+helper.update (tk, -1)
+assert (q:wait () == tk)
+helper.update (tk)
+assert (not pcall (timer.ticks, 0))		-- it would never sleep
+
 if true then 
 
 	function de_dos ()
@@ -57,6 +57,24 @@ print ("curtask:", th:currenttask ())
 print ("t1:", helper.state (t1), "t2:", helper.state (t2))
 helper.update (tx)
 
+-- a yielded task goes back to its input queue when updated
+ty = helper.null (2)
+q1:addtask (ty)
+for i = 1, 2 do
+	tx = q2:wait ()
+	assert (tx == ty and helper.state (tx) == "Yielded")
+	assert (helper.update (tx) == i)
+	local st = helper.state (tx)
+	print ("yielded:", i, st)
+	assert (st ~= "Ready" and st ~= "Finished")		-- a helper might have it already
+end
+tx = q2:wait ()
+assert (tx == ty and helper.state (tx) == "Done")
+assert (helper.update (tx) == 3)
+
+-- run by the Lua thread, it can't yield: work() is just called again
+assert (helper.update (helper.null (2)) == 3)
+
 tk = timer.ticks (1.5)
 print ("tk:", tk)
 q1:addtask (tk)
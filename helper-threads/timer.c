@@ -4,9 +4,12 @@
  * $Id: timer.c,v 1.4 2007-07-31 23:53:34 jguerra Exp $
  */
 
-#include <sys/time.h>
+#define _XOPEN_SOURCE 600
 #include <stdlib.h>
 #include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
 
 #include "lua.h"
 #include "lauxlib.h"
@@ -14,126 +17,327 @@
 #include "helper.h"
 
 /*
- * one shot timer
+ * all timers are kept in a single min-heap, served by one thread
+ * that sleeps until the earliest deadline and then completes the
+ * expired tasks. a helper only spends the time needed to add the
+ * timer to the heap, so sleeping tasks don't take any thread.
  */
- 
+
 typedef struct timer_udata {
-	struct timeval tv;
+	lua_Number t;					/* period, in seconds */
+	struct timespec when;			/* next deadline, CLOCK_MONOTONIC */
+	void *task;
+	int ticks;
+	int end, done;
 	int ret;
+	long fired;						/* periods elapsed since the last update */
 } timer_udata;
 
-static int timer_prepare (lua_State *L, void **udata) {
+static struct {
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	pthread_t pth;
+	int running, stop;
+	timer_udata **heap;
+	size_t n, size;
+} tsrv = {PTHREAD_MUTEX_INITIALIZER};
+
+static void ts_add (struct timespec *ts, lua_Number t) {
+	long sec = (long) t;
+	ts->tv_sec += sec;
+	ts->tv_nsec += (long) ((t - sec) * 1000000000);
+	if (ts->tv_nsec >= 1000000000) {
+		ts->tv_sec++;
+		ts->tv_nsec -= 1000000000;
+	}
+}
+
+static int ts_before (const struct timespec *a, const struct timespec *b) {
+	return a->tv_sec < b->tv_sec || (a->tv_sec == b->tv_sec && a->tv_nsec < b->tv_nsec);
+}
+
+static double ts_diff (const struct timespec *a, const struct timespec *b) {
+	return (a->tv_sec - b->tv_sec) + (a->tv_nsec - b->tv_nsec) / 1e9;
+}
+
+/*
+ * next deadline of a ticks timer, a whole period after the last one
+ * so the processing time doesn't add drift.  if it's already past,
+ * the periods missed are skipped (and counted)
+ */
+static void tick_rearm (timer_udata *td, const struct timespec *now) {
+	td->fired++;
+	ts_add (&td->when, td->t);
+	if (!ts_before (now, &td->when)) {
+		long missed = (long) (ts_diff (now, &td->when) / td->t) + 1;
+		ts_add (&td->when, missed * td->t);
+		td->fired += missed;
+	}
+}
+
+/**************************************
+ * heap, ordered by deadline
+ **************************************/
+static int heap_push (timer_udata *td) {
+	size_t i;
+
+	if (tsrv.n >= tsrv.size) {
+		size_t size = tsrv.size ? tsrv.size * 2 : 64;
+		timer_udata **heap = (timer_udata **)realloc (tsrv.heap, size * sizeof (timer_udata *));
+		if (!heap)
+			return 0;
+		tsrv.heap = heap;
+		tsrv.size = size;
+	}
+
+	for (i = tsrv.n++; i > 0; i = (i-1) / 2) {
+		timer_udata *parent = tsrv.heap [(i-1) / 2];
+		if (!ts_before (&td->when, &parent->when))
+			break;
+		tsrv.heap [i] = parent;
+	}
+	tsrv.heap [i] = td;
+	return 1;
+}
+
+static timer_udata *heap_pop (void) {
+	timer_udata *top, *last;
+	size_t i, child;
+
+	if (tsrv.n == 0)
+		return NULL;
+
+	top = tsrv.heap [0];
+	last = tsrv.heap [--tsrv.n];
+	for (i = 0; (child = 2*i + 1) < tsrv.n; i = child) {
+		if (child+1 < tsrv.n && ts_before (&tsrv.heap [child+1]->when, &tsrv.heap [child]->when))
+			child++;
+		if (!ts_before (&tsrv.heap [child]->when, &last->when))
+			break;
+		tsrv.heap [i] = tsrv.heap [child];
+	}
+	tsrv.heap [i] = last;
+	return top;
+}
+
+/**************************************
+ * timer service thread
+ **************************************/
+static void *timer_service (void *arg) {
+	timer_udata *expired [64];
+
+	pthread_mutex_lock (&tsrv.lock);
+	while (!tsrv.stop) {
+		struct timespec now;
+		size_t n = 0, i;
+
+		if (tsrv.n == 0) {
+			pthread_cond_wait (&tsrv.changed, &tsrv.lock);
+			continue;
+		}
+
+		clock_gettime (CLOCK_MONOTONIC, &now);
+		if (ts_before (&now, &tsrv.heap [0]->when)) {
+			pthread_cond_timedwait (&tsrv.changed, &tsrv.lock, &tsrv.heap [0]->when);
+			continue;
+		}
+
+		while (n < sizeof (expired) / sizeof (expired [0])
+				&& tsrv.n > 0 && !ts_before (&now, &tsrv.heap [0]->when)) {
+			timer_udata *td = heap_pop ();
+			if (td->ticks && !td->end) {
+				tick_rearm (td, &now);
+				if (!heap_push (td)) {
+					td->ret = ENOMEM;
+					td->done = 1;
+				}
+			} else
+				td->done = 1;
+			expired [n++] = td;
+		}
+
+		/* complete them without the lock, ticks_update() needs it */
+		pthread_mutex_unlock (&tsrv.lock);
+		for (i = 0; i < n; i++)
+			complete_task (expired [i]->task, expired [i]->done);
+		pthread_mutex_lock (&tsrv.lock);
+	}
+	pthread_mutex_unlock (&tsrv.lock);
+
+	return NULL;
+}
+
+static int service_start (void) {
+	pthread_condattr_t attr;
+	int ret;
+
+	if (tsrv.running)
+		return 0;
+
+	pthread_condattr_init (&attr);
+	pthread_condattr_setclock (&attr, CLOCK_MONOTONIC);
+	pthread_cond_init (&tsrv.changed, &attr);
+	pthread_condattr_destroy (&attr);
+
+	tsrv.stop = 0;
+	ret = pthread_create (&tsrv.pth, NULL, timer_service, NULL);
+	tsrv.running = (ret == 0);
+	return ret;
+}
+
+/* joins the service thread before the library is unloaded */
+static int service_gc (lua_State *L) {
+	pthread_mutex_lock (&tsrv.lock);
+	if (!tsrv.running) {
+		pthread_mutex_unlock (&tsrv.lock);
+		return 0;
+	}
+	tsrv.stop = 1;
+	pthread_cond_signal (&tsrv.changed);
+	pthread_mutex_unlock (&tsrv.lock);
+
+	pthread_join (tsrv.pth, NULL);
+	tsrv.running = 0;
+	return 0;
+}
+
+/**************************************
+ * common task functions
+ **************************************/
+static int timer_new (lua_State *L, void **udata, int ticks) {
 	lua_Number t = luaL_checknumber (L, 1);
 	timer_udata *td = (timer_udata *)malloc (sizeof (timer_udata));
 	if (!td)
 		luaL_error (L, "can't alloc udata");
-	
-	td->tv.tv_sec = (int) t;
-	td->tv.tv_usec = (t - td->tv.tv_sec) * 1000000;
-	
+
+	td->t = t;
+	td->task = NULL;
+	td->ticks = ticks;
+	td->end = 0;
+	td->done = 0;
+	td->ret = 0;
+	td->fired = 0;
+
 	*udata = td;
-	
+
 	return 0;
 }
 
+/*
+ * run by the Lua thread there's no task to hand to the service, so it
+ * just sleeps here; a ticks timer is done after its first tick.
+ */
 static int timer_work (void *udata) {
 	timer_udata *td = (timer_udata *)udata;
-	fd_set fd_a, fd_b, fd_c;
-	FD_ZERO (&fd_a);
-	FD_ZERO (&fd_b);
-	FD_ZERO (&fd_c);
-	
-	td->ret = select (0, &fd_a, &fd_b, &fd_c, &td->tv);
-	
+	void *task = detach_task ();
+
+	clock_gettime (CLOCK_MONOTONIC, &td->when);
+	ts_add (&td->when, td->t);
+	if (!task) {
+		while (clock_nanosleep (CLOCK_MONOTONIC, TIMER_ABSTIME, &td->when, NULL) == EINTR)
+			;
+		td->done = 1;
+		return 0;
+	}
+
+	pthread_mutex_lock (&tsrv.lock);
+	td->task = task;
+	td->ret = service_start ();
+	if (td->ret == 0 && heap_push (td)) {
+		if (tsrv.heap [0] == td)
+			pthread_cond_signal (&tsrv.changed);
+	} else {
+		if (td->ret == 0)
+			td->ret = ENOMEM;
+		td->done = 1;
+		complete_task (task, 1);
+	}
+	pthread_mutex_unlock (&tsrv.lock);
+
 	return 0;
 }
 
+/*
+ * one shot timer
+ */
+static int timer_prepare (lua_State *L, void **udata) {
+	return timer_new (L, udata, 0);
+}
+
 static int timer_finish (lua_State *L, void *udata) {
 	timer_udata *td = (timer_udata *)udata;
 	int ret = td->ret;
 	free(td);
-	
-	if (ret < 0)
+
+	if (ret != 0)
 		luaL_error (L, strerror (ret));
-	
+
 	return 0;
 }
 
 static const task_ops timer_ops = {
 	timer_prepare,
 	timer_work,
-	timer_finish
+	timer_finish,
+	NULL,
+	TASK_LATENCY
 };
 
 
 /*
  * repeated ticks timer
  */
-
-typedef struct ticks_udata {
-	lua_Number t;
-	/*	struct timeval tv;*/
-	int ret, end;
-} ticks_udata;
-
 static int ticks_prepare (lua_State *L, void **udata) {
-	lua_Number t = luaL_checknumber (L, 1);
-	ticks_udata *td = (ticks_udata *)malloc (sizeof (ticks_udata));
-	if (!td)
-		luaL_error (L, "can't alloc udata");
-	
-	td->t = t;
-	td->end = 0;
-	
-	*udata = td;
-	
-	return 0;
-}
-
-static int ticks_work (void *udata) {
-	ticks_udata *td = (ticks_udata *)udata;
-	fd_set fd_a, fd_b, fd_c;
-	struct timeval tv;
-	
-	FD_ZERO (&fd_a);
-	FD_ZERO (&fd_b);
-	FD_ZERO (&fd_c);
-	
-	while (!td->end) {
-	
-		tv.tv_sec = (int) td->t;
-		tv.tv_usec = (td->t - tv.tv_sec) * 1000000;
-		
-		td->ret = select (0, &fd_a, &fd_b, &fd_c, &tv);
-		signal_task (0);
-	}
-	
-	return 0;
+	luaL_argcheck (L, luaL_checknumber (L, 1) > 0, 1, "the period must be positive");
+	return timer_new (L, udata, 1);
 }
 
+/* returns the number of ticks missed since the last update */
 static int ticks_update (lua_State *L, void *udata) {
-	ticks_udata *td = (ticks_udata *)udata;
-	
-	if (td->end) {
+	timer_udata *td = (timer_udata *)udata;
+	long missed;
+
+	pthread_mutex_lock (&tsrv.lock);
+	if (td->done) {
 		int ret = td->ret;
+		pthread_mutex_unlock (&tsrv.lock);
 		free (td);
-		if (ret < 0)
+		if (ret != 0)
 			luaL_error (L, strerror (ret));
-	} else {
-		if (lua_isnumber (L, 1)) {
-			td->t = lua_tonumber(L, 1);
-			if (td->t < 0)
-				td->end = 1;
-		}
+		return 0;
 	}
-	
-	return 0;
+
+	if (lua_isnumber (L, 1)) {
+		lua_Number t = lua_tonumber (L, 1);
+		if (t > 0)
+			td->t = t;
+		else if (t < 0)
+			td->end = 1;
+	}
+	missed = td->fired > 0 ? td->fired - 1 : 0;
+	td->fired = 0;
+	pthread_mutex_unlock (&tsrv.lock);
+
+	lua_pushnumber (L, missed);
+	return 1;
+}
+
+/* nobody waits for the ticks anymore, they end with the next one */
+static void ticks_cancel (void *udata) {
+	timer_udata *td = (timer_udata *)udata;
+
+	pthread_mutex_lock (&tsrv.lock);
+	td->end = 1;
+	pthread_mutex_unlock (&tsrv.lock);
 }
 
 static const task_ops ticks_ops = {
 	ticks_prepare,
-	ticks_work,
-	ticks_update
+	timer_work,
+	ticks_update,
+	NULL,
+	TASK_LATENCY,
+	ticks_cancel
 };
 
 static const task_reg timer_reg[] = {
@@ -147,7 +351,14 @@ int luaopen_timer (lua_State *L) {
 
 	helper_init (L);
 
+	lua_newuserdata (L, 1);
+	lua_newtable (L);
+	lua_pushcfunction (L, service_gc);
+	lua_setfield (L, -2, "__gc");
+	lua_setmetatable (L, -2);
+	luaL_ref (L, LUA_REGISTRYINDEX);
+
 	tasklib (L, "timer", timer_reg);
-	
+
 	return 1;
 }